@@ -145,6 +145,11 @@ bool VoodooI2CController::start(IOService* provider) {
     provider->setProperty("VoodooI2CServices Supported", kOSBooleanTrue);
     provider->setProperty("isI2CController", kOSBooleanTrue);
 
+    if (OSBoolean* dynamic_tar_update = OSDynamicCast(OSBoolean, getProperty("DynamicTARUpdate"))) {
+        physical_device.dynamic_tar_update = dynamic_tar_update->getValue();
+        IOLog("%s::%s DynamicTARUpdate: %d\n", getName(), physical_device.name, physical_device.dynamic_tar_update);
+    }
+
     return true;
 
 exit:
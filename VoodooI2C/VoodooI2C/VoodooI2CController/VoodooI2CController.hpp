@@ -27,6 +27,8 @@ typedef struct {
     IOMemoryMap* mmap;
     IOService* provider;
     bool access_intr_mask_workaround = false;
+    bool dynamic_tar_update = false;
+    bool has_idma = false;
 } VoodooI2CControllerPhysicalDevice;
 
 class VoodooI2CControllerNub;
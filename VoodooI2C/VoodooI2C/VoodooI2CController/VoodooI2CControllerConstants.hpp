@@ -14,18 +14,25 @@
 #define DW_IC_CON_MASTER                0x1
 #define DW_IC_CON_SPEED_STD             0x2
 #define DW_IC_CON_SPEED_FAST            0x4
+#define DW_IC_CON_SPEED_HIGH            0x6
+#define DW_IC_CON_SPEED_MASK            0x6
 #define DW_IC_CON_10BITADDR_MASTER      0x10
 #define DW_IC_CON_RESTART_EN            0x20
 #define DW_IC_CON_SLAVE_DISABLE         0x40
 
 #define I2C_FUNC_I2C                    0x00000001
 #define I2C_FUNC_10BIT_ADDR             0x00000002
+#define I2C_FUNC_SMBUS_PEC              0x00000008
+#define I2C_FUNC_SMBUS_QUICK            0x00010000
 #define I2C_FUNC_SMBUS_READ_BYTE        0x00020000
 #define I2C_FUNC_SMBUS_WRITE_BYTE       0x00040000
 #define I2C_FUNC_SMBUS_READ_BYTE_DATA   0x00080000
 #define I2C_FUNC_SMBUS_WRITE_BYTE_DATA  0x00100000
 #define I2C_FUNC_SMBUS_READ_WORD_DATA   0x00200000
 #define I2C_FUNC_SMBUS_WRITE_WORD_DATA  0x00400000
+#define I2C_FUNC_SMBUS_PROC_CALL        0x00800000
+#define I2C_FUNC_SMBUS_READ_BLOCK_DATA  0x01000000
+#define I2C_FUNC_SMBUS_WRITE_BLOCK_DATA 0x02000000
 #define I2C_FUNC_SMBUS_READ_I2C_BLOCK   0x04000000
 #define I2C_FUNC_SMBUS_WRITE_I2C_BLOCK  0x08000000
 
@@ -33,6 +40,7 @@
 #define I2C_FUNC_SMBUS_BYTE_DATA (I2C_FUNC_SMBUS_READ_BYTE_DATA | I2C_FUNC_SMBUS_WRITE_BYTE_DATA)
 #define I2C_FUNC_SMBUS_WORD_DATA (I2C_FUNC_SMBUS_READ_WORD_DATA | I2C_FUNC_SMBUS_WRITE_WORD_DATA)
 #define I2C_FUNC_SMBUS_I2C_BLOCK (I2C_FUNC_SMBUS_READ_I2C_BLOCK | I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)
+#define I2C_FUNC_SMBUS_BLOCK_DATA (I2C_FUNC_SMBUS_READ_BLOCK_DATA | I2C_FUNC_SMBUS_WRITE_BLOCK_DATA)
 
 #define DW_IC_CON 0x0
 #define DW_IC_TAR 0x4
@@ -42,6 +50,8 @@
 #define DW_IC_SS_SCL_LCNT 0x18
 #define DW_IC_FS_SCL_HCNT 0x1c
 #define DW_IC_FS_SCL_LCNT 0x20
+#define DW_IC_HS_SCL_HCNT 0x24
+#define DW_IC_HS_SCL_LCNT 0x28
 #define DW_IC_INTR_STAT 0x2c
 #define DW_IC_INTR_MASK 0x30
 #define DW_IC_RAW_INTR_STAT 0x34
@@ -64,14 +74,28 @@
 #define DW_IC_RXFLR 0x78
 #define DW_IC_SDA_HOLD 0x7c
 #define DW_IC_TX_ABRT_SOURCE 0x80
+#define DW_IC_DMA_CR 0x88
+#define DW_IC_DMA_TDLR 0x8c
+#define DW_IC_DMA_RDLR 0x90
 #define DW_IC_ENABLE_STATUS 0x9c
 #define DW_IC_CLR_RESTART_DET 0xa8
 #define DW_IC_COMP_PARAM_1 0xf4
+#define DW_IC_COMP_PARAM_1_SPEED_MODE_HIGH (BIT(2) | BIT(3))
+#define DW_IC_COMP_PARAM_1_SPEED_MODE_MASK (BIT(2) | BIT(3))
 #define DW_IC_COMP_VERSION 0xf8
 #define DW_IC_SDA_HOLD_MIN_VERS 0x3131312A /* "111*" == v1.11* */
 #define DW_IC_COMP_TYPE 0xfc
 #define DW_IC_COMP_TYPE_VALUE 0x44570140 /* "DW" + 0x0140 */
 
+/* Controller quirks, resolved once at probe from the ACPI name or the PCI device ID */
+#define DW_IC_QUIRK_AMD_CLOCK_GATING        BIT(0)
+#define DW_IC_QUIRK_SUNRISE_POINT_DEFAULTS  BIT(1)
+#define DW_IC_QUIRK_BAYTRAIL_DUMMY_READ     BIT(2)
+#define DW_IC_QUIRK_ACCESS_INTR_MASK        BIT(3)
+
+/* Shadow copies cover the registers up to DW_IC_TX_TL, indexed by offset / 4 */
+#define DW_IC_SHADOW_COUNT ((DW_IC_TX_TL >> 2) + 1)
+
 #define DW_IC_INTR_RX_UNDER BIT(0)
 #define DW_IC_INTR_RX_OVER BIT(1)
 #define DW_IC_INTR_RX_FULL BIT(2)
@@ -86,6 +110,9 @@
 #define DW_IC_INTR_GEN_CALL BIT(11)
 #define DW_IC_INTR_RESTART_DET BIT(12)
 
+#define DW_IC_DMA_CR_RDMAE BIT(0)
+#define DW_IC_DMA_CR_TDMAE BIT(1)
+
 #define DW_IC_INTR_DEFAULT_MASK (DW_IC_INTR_RX_FULL | DW_IC_INTR_TX_ABRT | DW_IC_INTR_STOP_DET | DW_IC_INTR_TX_EMPTY)
 
 #define DW_IC_ERR_TX_ABRT 0x1
@@ -97,11 +124,52 @@
 #define I2C_M_TEN 0x0010
 #define I2C_M_RD 0x0001
 #define I2C_M_RECV_LEN 0x0400
+#define I2C_CLIENT_PEC 0x0004  // the last byte of the message is an SMBus PEC
+#define I2C_M_RECV_LEN16 0x0100  // 2-byte little-endian length header covering the whole message, as in HID over I2C
+#define I2C_M_NOSTART 0x4000  // continue the preceding write without a RESTART or a new address byte
+
+#define I2C_M_RECV_LEN_HEADER(flags) (((flags) & I2C_M_RECV_LEN16) ? 2 : (((flags) & I2C_M_RECV_LEN) ? 1 : 0))
 
 #define DW_IC_TAR_10BITADDR_MASTER BIT(12)
+#define DW_IC_TAR_SPECIAL BIT(11)
+#define DW_IC_TAR_SMBUS_QUICK_CMD BIT(16)
 
 #define BIT(nr)                 (1UL << (nr))
 
+/* Intel LPSS integrated DMA (iDMA 64-bit) that sits next to the I2C block */
+#define LPSS_IDMA 0x800
+#define IDMA64_TX_CHANNEL 0
+#define IDMA64_RX_CHANNEL 1
+#define IDMA64_CH_LENGTH 0x58
+#define IDMA64_CH(channel, reg) (LPSS_IDMA + (channel) * IDMA64_CH_LENGTH + (reg))
+
+#define IDMA64_CH_SAR 0x00
+#define IDMA64_CH_DAR 0x08
+#define IDMA64_CH_LLP 0x10
+#define IDMA64_CH_CTL_LO 0x18
+#define IDMA64_CH_CTL_HI 0x1c
+#define IDMA64_CH_CFG_LO 0x40
+#define IDMA64_CH_CFG_HI 0x44
+
+#define IDMA64_CFG (LPSS_IDMA + 0x398)
+#define IDMA64_CH_EN (LPSS_IDMA + 0x3a0)
+#define IDMA64_CFG_DMA_EN BIT(0)
+
+#define IDMA64C_CTLL_DST_WIDTH(x) ((x) << 1)
+#define IDMA64C_CTLL_SRC_WIDTH(x) ((x) << 4)
+#define IDMA64C_CTLL_DST_FIX BIT(8)
+#define IDMA64C_CTLL_SRC_FIX BIT(10)
+#define IDMA64C_CTLL_FC_M2P (1 << 20)
+#define IDMA64C_CTLL_FC_P2M (2 << 20)
+#define IDMA64C_CTLH_BLOCK_TS(x) ((x) & (BIT(17) - 1))
+#define IDMA64C_CFGH_SRC_PER(x) ((x) << 0)
+#define IDMA64C_CFGH_DST_PER(x) ((x) << 4)
+
+/* The bounce buffer holds one DW_IC_DATA_CMD word per command followed by one byte per read */
+#define IDMA_MAX_COMMANDS 1024
+#define IDMA_RX_OFFSET (IDMA_MAX_COMMANDS * sizeof(UInt32))
+#define IDMA_BUFFER_SIZE (IDMA_RX_OFFSET + IDMA_MAX_COMMANDS)
+
 #define ABRT_7B_ADDR_NOACK  0
 #define ABRT_10ADDR1_NOACK  1
 #define ABRT_10ADDR2_NOACK  2
@@ -150,4 +218,9 @@ DW_IC_TX_ABRT_GCALL_NOACK)
 #define DW_IC_SDA_HOLD_RX_SHIFT 16
 #define DW_IC_SDA_HOLD_RX_MASK  GENMASK(23, 16)
 
+#define I2C_MAX_STANDARD_MODE_FREQ 100000
+#define I2C_MAX_FAST_MODE_FREQ 400000
+#define I2C_MAX_FAST_MODE_PLUS_FREQ 1000000
+#define I2C_MAX_HIGH_SPEED_MODE_FREQ 3400000
+
 #endif /* VoodooI2CControllerConstants_h */
@@ -9,9 +9,7 @@
 
 #include "VoodooI2CControllerDriver.hpp"
 #include "VoodooI2CController.hpp"
-
-#define readRegister(X) nub->readRegister(X)
-#define writeRegister(X, Y) nub->writeRegister(X, Y)
+#include "VoodooI2CControllerTiming.hpp"
 
 #define super IOService
 OSDefineMetaClassAndStructors(VoodooI2CControllerDriver, IOService);
@@ -19,33 +17,14 @@ OSDefineMetaClassAndStructors(VoodooI2CControllerDriver, IOService);
 void VoodooI2CControllerDriver::free() {
     OSSafeReleaseNULL(device_nubs);
 
+    if (bus_device.state) {
+        IOFreeAligned(bus_device.state, sizeof(VoodooI2CControllerTransferState));
+        bus_device.state = nullptr;
+    }
+
     super::free();
 }
 
-constexpr uint64_t KILO = 1000;
-constexpr uint64_t MICRO = 1000000;
-
-#define do_div(n, base)                                                        \
-  ({                                                                           \
-    uint32_t __base = (base);                                                  \
-    uint32_t __rem;                                                            \
-    __rem = (static_cast<uint64_t>(n)) % __base;                               \
-    (n) = (static_cast<uint64_t>(n)) / __base;                                 \
-    __rem;                                                                     \
-  })
-
-/*
- * Same as above but for u64 dividends. divisor must be a 32-bit
- * number.
- */
-#define DIV_ROUND_CLOSEST_ULL(x, divisor)                                      \
-  ({                                                                           \
-    __decltype(divisor) __d = divisor;                                         \
-    unsigned long long _tmp = (x) + (__d) / 2;                                 \
-    do_div(_tmp, __d);                                                         \
-    _tmp;                                                                      \
-  })
-
 static inline SInt64 div_s64_rem(SInt64 dividend, SInt32 divisor,
                                  SInt32 *remainder) {
     *remainder = dividend % divisor;
@@ -65,14 +44,80 @@ static inline SInt64 div_s64(SInt64 dividend, SInt32 divisor) {
                              : div_s64((__x - (__d / 2)), __d);                \
   })
 
-static UInt32 getClkRateFor(const char *name) {
-    if (!strncmp(name, "AMD0010", sizeof("AMD0010"))) {
-        return 133000000 / KILO;
-    } else if (!strncmp(name, "AMDI0010", sizeof("AMDI0010")) || !strncmp(name, "AMDI0019", sizeof("AMDI0019"))) {
-        return 150000000 / KILO;
-    } else {
-        return 0;
+/* Input clock rates (in kHz, as documented by the Linux LPSS and AMD drivers) and quirks of the controllers we know */
+static constexpr struct {
+    const char* name;
+    UInt32 clock_rate;
+    UInt32 quirks;
+} acpi_controller_quirks[] = {
+    {"AMD0010",  133000, DW_IC_QUIRK_AMD_CLOCK_GATING},
+    {"AMDI0010", 150000, DW_IC_QUIRK_AMD_CLOCK_GATING},
+    {"AMDI0019", 150000, DW_IC_QUIRK_AMD_CLOCK_GATING},
+    {"AMDI0510", 0,      DW_IC_QUIRK_AMD_CLOCK_GATING},
+    {"INT33C2",  100000, 0},    // Haswell
+    {"INT33C3",  100000, 0},
+    {"INT3432",  100000, 0},    // Broadwell
+    {"INT3433",  100000, 0},
+    {"80860F41", 100000, DW_IC_QUIRK_BAYTRAIL_DUMMY_READ},  // Bay Trail
+    {"808622C1", 133000, DW_IC_QUIRK_BAYTRAIL_DUMMY_READ},  // Cherry Trail / Braswell
+    {"INT344B",  120000, DW_IC_QUIRK_SUNRISE_POINT_DEFAULTS},   // Sunrise Point in ACPI mode
+    {"INT345D",  120000, DW_IC_QUIRK_SUNRISE_POINT_DEFAULTS},
+};
+
+/*
+ * The clock rates of the PCI controllers follow the i2c_info that intel-lpss-pci.c in Linux binds to each device
+ * ID: spt_i2c_info is 120 MHz, bxt_i2c_info is 133 MHz, glk_i2c_info is 138.4 MHz and cnl_i2c_info is 216 MHz.
+ */
+static constexpr struct {
+    UInt16 first_device_id;
+    UInt16 last_device_id;
+    UInt32 clock_rate;
+    UInt32 quirks;
+} pci_controller_quirks[] = {
+    {0x0aac, 0x0abb, 133000, 0},    // Broxton, bxt_i2c_info
+    {0x5aac, 0x5abb, 133000, 0},    // Apollo Lake, bxt_i2c_info
+    {0x31ac, 0x31bb, 138400, 0},    // Gemini Lake, glk_i2c_info
+    {0x9d60, 0x9d65, 120000, 0},    // Sunrise Point-LP, spt_i2c_info
+    {0xa160, 0xa163, 120000, 0},    // Sunrise Point-H, spt_i2c_info
+    {0xa2e0, 0xa2e3, 120000, 0},    // Kaby Lake-H, spt_i2c_info
+    {0x9dc5, 0x9dc6, 216000, 0},    // Cannon Lake-LP, cnl_i2c_info
+    {0x9de8, 0x9deb, 216000, 0},
+    {0xa368, 0xa36b, 216000, 0},    // Cannon Lake-H, cnl_i2c_info
+    {0x02c5, 0x02c6, 216000, 0},    // Comet Lake-LP, cnl_i2c_info
+    {0x02e8, 0x02eb, 216000, 0},
+    {0x06e8, 0x06eb, 216000, 0},    // Comet Lake-H, cnl_i2c_info
+    {0x34c5, 0x34c6, 133000, 0},    // Ice Lake-LP, bxt_i2c_info
+    {0x34e8, 0x34eb, 133000, 0},
+    {0xa0c5, 0xa0c6, 120000, 0},    // Tiger Lake-LP, spt_i2c_info
+    {0xa0d8, 0xa0d9, 120000, 0},
+    {0xa0e8, 0xa0eb, 120000, 0},
+    {0x51c5, 0x51c6, 133000, 0},    // Alder Lake-P, bxt_i2c_info
+    {0x51d8, 0x51d9, 133000, 0},
+    {0x51e8, 0x51eb, 133000, 0},
+};
+
+static UInt32 getControllerQuirks(VoodooI2CControllerPhysicalDevice* physical_device, UInt32* clock_rate) {
+    *clock_rate = 0;
+
+    for (auto& entry : acpi_controller_quirks) {
+        if (!strncmp(physical_device->name, entry.name, strlen(entry.name) + 1)) {
+            *clock_rate = entry.clock_rate;
+            return entry.quirks;
+        }
     }
+
+    if (physical_device->pci_device) {
+        UInt16 device_id = physical_device->pci_device->configRead16(kIOPCIConfigDeviceID);
+
+        for (auto& entry : pci_controller_quirks) {
+            if (device_id >= entry.first_device_id && device_id <= entry.last_device_id) {
+                *clock_rate = entry.clock_rate;
+                return entry.quirks;
+            }
+        }
+    }
+
+    return 0;
 }
 
 IOReturn VoodooI2CControllerDriver::getBusConfig() {
@@ -83,16 +128,28 @@ IOReturn VoodooI2CControllerDriver::getBusConfig() {
     auto rx_fifo_depth = ((param >> 8)  & 0xff) + 1;
     bus_device.transaction_fifo_depth = tx_fifo_depth;
     bus_device.receive_fifo_depth = rx_fifo_depth;
+    bus_device.high_speed_capable = (param & DW_IC_COMP_PARAM_1_SPEED_MODE_MASK) == DW_IC_COMP_PARAM_1_SPEED_MODE_HIGH;
 
-    auto i2c_clk = getClkRateFor(nub->controller->physical_device.name);
+    auto i2c_clk = bus_device.clock_rate;
 
-    bool is_sunrise_point = !strncmp(nub->controller->physical_device.name, "INT344B", sizeof("INT344B"))
-            || !strncmp(nub->controller->physical_device.name, "INT345D", sizeof("INT345D"));
+    /* Board specific signal timings from _DSD, falling back to the defaults used by Linux */
+    UInt32 scl_falling_time = 300;
+    UInt32 sda_falling_time = 300;
+    UInt32 sda_hold_time = 300;
+    nub->getACPIProperty("i2c-scl-falling-time-ns", &scl_falling_time);
+    nub->getACPIProperty("i2c-sda-falling-time-ns", &sda_falling_time);
+    bool sda_hold_from_dsd = nub->getACPIProperty("i2c-sda-hold-time-ns", &sda_hold_time) == kIOReturnSuccess;
+
+    /* calibrateBusTiming needs these to keep the counts it shortens within the specification */
+    bus_device.acpi_config.scl_falling_time = scl_falling_time;
+    bus_device.acpi_config.sda_falling_time = sda_falling_time;
+
+    bool is_sunrise_point = bus_device.quirks & DW_IC_QUIRK_SUNRISE_POINT_DEFAULTS;
 
     if (nub->getACPIParams((const char*)"SSCN", &bus_device.acpi_config.ss_hcnt, &bus_device.acpi_config.ss_lcnt, NULL) != kIOReturnSuccess) {
         if (i2c_clk) {
-            bus_device.acpi_config.ss_hcnt = (UInt32)DIV_ROUND_CLOSEST_ULL((UInt64)i2c_clk * (4000 + 300), MICRO) - 3;
-            bus_device.acpi_config.ss_lcnt = (UInt32)DIV_ROUND_CLOSEST_ULL((UInt64)i2c_clk * (4700 + 300), MICRO) - 1;
+            bus_device.acpi_config.ss_hcnt = i2c_dw_scl_hcnt(i2c_clk, 4000, sda_falling_time, 0, 0);
+            bus_device.acpi_config.ss_lcnt = i2c_dw_scl_lcnt(i2c_clk, 4700, scl_falling_time, 0);
         } else {
             bus_device.acpi_config.ss_hcnt = is_sunrise_point ? 0x01B0 : 0x03F2;
             bus_device.acpi_config.ss_lcnt = is_sunrise_point ? 0x01FB : 0x043D;
@@ -102,8 +159,8 @@ IOReturn VoodooI2CControllerDriver::getBusConfig() {
 
     if (nub->getACPIParams((const char*)"FMCN", &bus_device.acpi_config.fs_hcnt, &bus_device.acpi_config.fs_lcnt, &bus_device.acpi_config.sda_hold) != kIOReturnSuccess) {
         if (i2c_clk) {
-            bus_device.acpi_config.fs_hcnt = (UInt32)DIV_ROUND_CLOSEST_ULL((UInt64)i2c_clk * (600 + 300), MICRO) - 3;
-            bus_device.acpi_config.fs_lcnt = (UInt32)DIV_ROUND_CLOSEST_ULL((UInt64)i2c_clk * (1300 + 300), MICRO) - 1;
+            bus_device.acpi_config.fs_hcnt = i2c_dw_scl_hcnt(i2c_clk, 600, sda_falling_time, 0, 0);
+            bus_device.acpi_config.fs_lcnt = i2c_dw_scl_lcnt(i2c_clk, 1300, scl_falling_time, 0);
         } else {
             bus_device.acpi_config.fs_hcnt = is_sunrise_point ? 0x48 : 0x0101;
             bus_device.acpi_config.fs_lcnt = is_sunrise_point ? 0xA0 : 0x012C;
@@ -111,9 +168,32 @@ IOReturn VoodooI2CControllerDriver::getBusConfig() {
         }
     }
 
-    if (readRegister(DW_IC_COMP_VERSION) >= DW_IC_SDA_HOLD_MIN_VERS) {
+    /* Fast-mode Plus runs off the fast mode registers, so it is only available with counts of its own */
+    if (nub->getACPIParams((const char*)"FPCN", &bus_device.acpi_config.fp_hcnt, &bus_device.acpi_config.fp_lcnt, NULL) != kIOReturnSuccess) {
+        if (i2c_clk) {
+            bus_device.acpi_config.fp_hcnt = i2c_dw_scl_hcnt(i2c_clk, 260, sda_falling_time, 0, 0);
+            bus_device.acpi_config.fp_lcnt = i2c_dw_scl_lcnt(i2c_clk, 500, scl_falling_time, 0);
+        } else {
+            bus_device.acpi_config.fp_hcnt = 0;
+            bus_device.acpi_config.fp_lcnt = 0;
+        }
+    }
+
+    if (bus_device.high_speed_capable &&
+        nub->getACPIParams((const char*)"HSCN", &bus_device.acpi_config.hs_hcnt, &bus_device.acpi_config.hs_lcnt, NULL) != kIOReturnSuccess) {
         if (i2c_clk) {
-            bus_device.acpi_config.sda_hold = (UInt32)DIV_S64_ROUND_CLOSEST((SInt64)i2c_clk * 300, MICRO);
+            bus_device.acpi_config.hs_hcnt = i2c_dw_scl_hcnt(i2c_clk, 160, sda_falling_time, 0, 0);
+            bus_device.acpi_config.hs_lcnt = i2c_dw_scl_lcnt(i2c_clk, 320, scl_falling_time, 0);
+        } else {
+            bus_device.acpi_config.hs_hcnt = 0;
+            bus_device.acpi_config.hs_lcnt = 0;
+        }
+    }
+
+    if (readRegister(DW_IC_COMP_VERSION) >= DW_IC_SDA_HOLD_MIN_VERS) {
+        /* The hold time from FMCN is tuned for the board, so the default only fills in where there is none */
+        if (i2c_clk && (sda_hold_from_dsd || !bus_device.acpi_config.sda_hold)) {
+            bus_device.acpi_config.sda_hold = (UInt32)DIV_S64_ROUND_CLOSEST((SInt64)i2c_clk * sda_hold_time, MICRO);
         }
 
         if (!bus_device.acpi_config.sda_hold) {
@@ -144,8 +224,232 @@ IOReturn VoodooI2CControllerDriver::getBusConfig() {
         return kIOReturnSuccess;
 }
 
+UInt64 VoodooI2CControllerDriver::countTransferBits(VoodooI2CControllerBusMessage* messages, int number) {
+    UInt64 bits = 2;  // START and STOP
+
+    /* Every message costs its address byte plus its data bytes, each followed by an (N)ACK bit */
+    for (int i = 0; i < number; i++)
+        bits += (messages[i].length + 1) * 9;
+
+    return bits;
+}
+
+UInt64 VoodooI2CControllerDriver::estimateTransferTime(VoodooI2CControllerBusMessage* messages, int number) {
+    return countTransferBits(messages, number) * getSCLPeriod();
+}
+
+void VoodooI2CControllerDriver::calibrateBusTiming() {
+    UInt32 *hcnt, *lcnt, high_time, low_time;
+    UInt32 minimum_hcnt, minimum_lcnt, new_hcnt, new_lcnt;
+
+    calibration.effective_rate = (UInt32)(calibration.bits * 1000000000ULL / calibration.nanoseconds);
+    setBusConfigProperties();
+
+    if (!calibration.enabled || !bus_device.clock_rate || calibration.effective_rate >= calibration.speed / 10 * 9)
+        return;
+
+    switch (calibration.speed) {
+        case I2C_MAX_STANDARD_MODE_FREQ:
+            hcnt = &bus_device.acpi_config.ss_hcnt;
+            lcnt = &bus_device.acpi_config.ss_lcnt;
+            high_time = 4000;
+            low_time = 4700;
+            break;
+        case I2C_MAX_FAST_MODE_FREQ:
+            hcnt = &bus_device.acpi_config.fs_hcnt;
+            lcnt = &bus_device.acpi_config.fs_lcnt;
+            high_time = 600;
+            low_time = 1300;
+            break;
+        case I2C_MAX_FAST_MODE_PLUS_FREQ:
+            hcnt = &bus_device.acpi_config.fp_hcnt;
+            lcnt = &bus_device.acpi_config.fp_lcnt;
+            high_time = 260;
+            low_time = 500;
+            break;
+        default:
+            return;
+    }
+
+    /*
+     * Keep 10% above the minimum SCL high and low times of the specification. The
+     * controller only starts counting once the opposite edge has fallen, so the
+     * fall times have to be added just like getBusConfig does.
+     */
+    minimum_hcnt = i2c_dw_scl_hcnt(bus_device.clock_rate, high_time * 11 / 10, bus_device.acpi_config.sda_falling_time, 0, 0);
+    minimum_lcnt = i2c_dw_scl_lcnt(bus_device.clock_rate, low_time * 11 / 10, bus_device.acpi_config.scl_falling_time, 0);
+
+    new_hcnt = *hcnt - *hcnt / 16;
+    if (new_hcnt < minimum_hcnt)
+        new_hcnt = minimum_hcnt;
+    if (new_hcnt > *hcnt)
+        new_hcnt = *hcnt;
+
+    new_lcnt = *lcnt - *lcnt / 16;
+    if (new_lcnt < minimum_lcnt)
+        new_lcnt = minimum_lcnt;
+    if (new_lcnt > *lcnt)
+        new_lcnt = *lcnt;
+
+    if (new_hcnt == *hcnt && new_lcnt == *lcnt)
+        return;
+
+    IOLog("%s::%s Bus runs at %u bit/s, tightening SCL counts from 0x%x/0x%x to 0x%x/0x%x\n", getName(), bus_device.name,
+          calibration.effective_rate, *hcnt, *lcnt, new_hcnt, new_lcnt);
+
+    *hcnt = new_hcnt;
+    *lcnt = new_lcnt;
+
+    /* Have setBusSpeed reprogram the counts before the next transfer */
+    bus_device.current_speed = 0;
+}
+
+void VoodooI2CControllerDriver::sampleBusTiming() {
+    VoodooI2CControllerBusMessage* messages = bus_device.state->messages;
+    UInt64 bits = countTransferBits(messages, bus_device.state->message_number);
+    UInt32 received = 0;
+    UInt64 elapsed;
+
+    /* Anything else includes the time the bus spent stretched while waiting for the driver */
+    if (bits < 100 || !calibration.run_started || bus_device.state->transfer_stopped <= calibration.run_started ||
+        bus_device.state->transaction_commands > bus_device.transaction_fifo_depth)
+        return;
+
+    for (int i = 0; i < bus_device.state->message_number; i++) {
+        if (I2C_M_RECV_LEN_HEADER(messages[i].flags))
+            return;
+        if (messages[i].flags & I2C_M_RD)
+            received += messages[i].length;
+    }
+
+    if (received > bus_device.receive_fifo_depth)
+        return;
+
+    if (calibration.speed != bus_device.current_speed) {
+        calibration.bits = 0;
+        calibration.nanoseconds = 0;
+        calibration.samples = 0;
+        calibration.speed = bus_device.current_speed;
+    }
+
+    absolutetime_to_nanoseconds(bus_device.state->transfer_stopped - calibration.run_started, &elapsed);
+    calibration.bits += bits;
+    calibration.nanoseconds += elapsed;
+
+    if (++calibration.samples < 16)
+        return;
+
+    calibrateBusTiming();
+
+    calibration.bits = 0;
+    calibration.nanoseconds = 0;
+    calibration.samples = 0;
+}
+
+UInt32 VoodooI2CControllerDriver::getTransferTimeout(UInt64 estimate) {
+    return (UInt32)(estimate * 2 / 1000) + clock_stretch_allowance;
+}
+
+UInt32 VoodooI2CControllerDriver::getSCLPeriod() {
+    UInt32 hcnt, lcnt, nominal;
+
+    if ((bus_device.bus_config & DW_IC_CON_SPEED_MASK) == DW_IC_CON_SPEED_STD) {
+        hcnt = bus_device.acpi_config.ss_hcnt;
+        lcnt = bus_device.acpi_config.ss_lcnt;
+        nominal = 10000;
+    } else if ((bus_device.bus_config & DW_IC_CON_SPEED_MASK) == DW_IC_CON_SPEED_HIGH) {
+        hcnt = bus_device.acpi_config.hs_hcnt;
+        lcnt = bus_device.acpi_config.hs_lcnt;
+        nominal = 294;
+    } else if (bus_device.current_speed > I2C_MAX_FAST_MODE_FREQ) {
+        hcnt = bus_device.acpi_config.fp_hcnt;
+        lcnt = bus_device.acpi_config.fp_lcnt;
+        nominal = 1000;
+    } else {
+        hcnt = bus_device.acpi_config.fs_hcnt;
+        lcnt = bus_device.acpi_config.fs_lcnt;
+        nominal = 2500;
+    }
+
+    if (!bus_device.clock_rate)
+        return nominal;
+
+    return (UInt32)DIV_ROUND_CLOSEST_ULL((UInt64)(hcnt + lcnt) * MICRO, bus_device.clock_rate);
+}
+
+UInt32 VoodooI2CControllerDriver::getSupportedBusSpeed(UInt32 speed) {
+    if (speed >= I2C_MAX_HIGH_SPEED_MODE_FREQ && bus_device.high_speed_capable && bus_device.acpi_config.hs_hcnt && bus_device.acpi_config.hs_lcnt)
+        return I2C_MAX_HIGH_SPEED_MODE_FREQ;
+
+    if (speed >= I2C_MAX_FAST_MODE_PLUS_FREQ && bus_device.acpi_config.fp_hcnt && bus_device.acpi_config.fp_lcnt)
+        return I2C_MAX_FAST_MODE_PLUS_FREQ;
+
+    if (speed >= I2C_MAX_FAST_MODE_FREQ)
+        return I2C_MAX_FAST_MODE_FREQ;
+
+    return I2C_MAX_STANDARD_MODE_FREQ;
+}
+
+UInt32 VoodooI2CControllerDriver::getTransferBusSpeed(UInt32 speed) {
+    UInt32 supported = getSupportedBusSpeed(speed ? speed : bus_device.bus_speed);
+
+    if (supported != I2C_MAX_HIGH_SPEED_MODE_FREQ && bus_device.speed_limit && supported > bus_device.speed_limit)
+        supported = getSupportedBusSpeed(bus_device.speed_limit);
+
+    return supported;
+}
+
+UInt32 VoodooI2CControllerDriver::getSpeedConfig(UInt32 speed) {
+    if (speed > I2C_MAX_FAST_MODE_PLUS_FREQ)
+        return DW_IC_CON_SPEED_HIGH;
+
+    if (speed > I2C_MAX_STANDARD_MODE_FREQ)
+        return DW_IC_CON_SPEED_FAST;
+
+    return DW_IC_CON_SPEED_STD;
+}
+
+IOReturn VoodooI2CControllerDriver::scanBus() {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CControllerDriver::scanBusGated));
+}
+
+IOReturn VoodooI2CControllerDriver::scanBusGated() {
+    UInt8 ack_map[16] = {};
+    OSData* data;
+    int found = 0;
+
+    for (UInt16 address = 0x08; address <= 0x77; address++) {
+        VoodooI2CControllerBusMessage message {
+            .address = address,
+            .buffer = nullptr,
+            .flags = I2C_M_RD,
+            .length = 0,
+        };
+        VoodooI2CControllerTransfer transfer {};
+
+        transfer.messages = &message;
+        transfer.number = 1;
+
+        if (transferI2CGated(&transfer) == kIOReturnSuccess) {
+            ack_map[address / 8] |= 1 << (address % 8);
+            found++;
+        }
+    }
+
+    IOLog("%s::%s Bus scan found %d device(s)\n", getName(), bus_device.name, found);
+
+    data = OSData::withBytes(ack_map, sizeof(ack_map));
+    if (!data)
+        return kIOReturnNoMemory;
+
+    setProperty("ACKMap", data);
+    data->release();
+
+    return kIOReturnSuccess;
+}
+
 IOReturn VoodooI2CControllerDriver::setBusConfigProperties() {
-    OSDictionary* properties = OSDictionary::withCapacity(5);
+    OSDictionary* properties = OSDictionary::withCapacity(10);
     if (!properties)
         return kIOReturnNoMemory;
 
@@ -153,177 +457,799 @@ IOReturn VoodooI2CControllerDriver::setBusConfigProperties() {
     setOSDictionaryNumber(properties, "SS_LCNT",  bus_device.acpi_config.ss_lcnt);
     setOSDictionaryNumber(properties, "FS_HCNT",  bus_device.acpi_config.fs_hcnt);
     setOSDictionaryNumber(properties, "FS_LCNT",  bus_device.acpi_config.fs_lcnt);
+    setOSDictionaryNumber(properties, "FP_HCNT",  bus_device.acpi_config.fp_hcnt);
+    setOSDictionaryNumber(properties, "FP_LCNT",  bus_device.acpi_config.fp_lcnt);
+    setOSDictionaryNumber(properties, "HS_HCNT",  bus_device.acpi_config.hs_hcnt);
+    setOSDictionaryNumber(properties, "HS_LCNT",  bus_device.acpi_config.hs_lcnt);
     setOSDictionaryNumber(properties, "SDA_HOLD", bus_device.acpi_config.sda_hold);
+    if (calibration.effective_rate)
+        setOSDictionaryNumber(properties, "EffectiveBitRate", calibration.effective_rate);
 
     setProperty("BusConfig", properties);
     OSSafeReleaseNULL(properties);
 
-    return kIOReturnSuccess;
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooI2CControllerDriver::setBusStatisticsProperties() {
+    OSDictionary* properties = OSDictionary::withCapacity(22);
+    if (!properties)
+        return kIOReturnNoMemory;
+
+    setOSDictionaryNumber(properties, "TransfersCompleted", bus_device.statistics.transfers_completed);
+    setOSDictionaryNumber(properties, "TransfersChained", bus_device.statistics.transfers_chained);
+    setOSDictionaryNumber(properties, "TransfersFailed", bus_device.statistics.transfers_failed);
+    setOSDictionaryNumber(properties, "QueueDepth", bus_device.statistics.queue_depth);
+    setOSDictionaryNumber(properties, "QueueDepthMax", bus_device.statistics.queue_depth_max);
+    setOSDictionaryNumber(properties, "LatencyLastUs", bus_device.statistics.latency_last_us);
+    setOSDictionaryNumber(properties, "LatencyMaxUs", bus_device.statistics.latency_max_us);
+    setOSDictionaryNumber(properties, "Interrupts", bus_device.statistics.interrupts);
+    setOSDictionaryNumber(properties, "ReceiveInterrupts", bus_device.statistics.receive_interrupts);
+    setOSDictionaryNumber(properties, "TransfersPrefilled", bus_device.statistics.transfers_prefilled);
+    setOSDictionaryNumber(properties, "TransfersPolled", bus_device.statistics.transfers_polled);
+    setOSDictionaryNumber(properties, "TransfersInterruptDriven", bus_device.statistics.transfers_interrupt);
+    setOSDictionaryNumber(properties, "PolledFallbacks", bus_device.statistics.polled_fallbacks);
+    setOSDictionaryNumber(properties, "TransfersTimedOut", bus_device.statistics.transfers_timed_out);
+    setOSDictionaryNumber(properties, "RecoveryLatencyUs", bus_device.statistics.recovery_latency_last_us);
+    setOSDictionaryNumber(properties, "IdleWaitsSkipped", bus_device.statistics.idle_waits_skipped);
+    setOSDictionaryNumber(properties, "IdleWaitsDeferred", bus_device.statistics.idle_waits_deferred);
+    setOSDictionaryNumber(properties, "TransfersDMA", bus_device.statistics.transfers_dma);
+    setOSDictionaryNumber(properties, "DMACommands", bus_device.statistics.dma_commands);
+#ifdef DEBUG
+    /* Only debug builds count register accesses, release builds keep the accessors down to a load or a store */
+    setOSDictionaryNumber(properties, "RegisterAccesses", bus_device.statistics.register_accesses);
+    setOSDictionaryNumber(properties, "InterruptRegisterAccesses", bus_device.statistics.interrupt_register_accesses);
+    if (bus_device.statistics.interrupts)
+        setOSDictionaryNumber(properties, "RegisterAccessesPerInterrupt", bus_device.statistics.interrupt_register_accesses / bus_device.statistics.interrupts);
+#endif
+
+    setProperty("BusStatistics", properties);
+    OSSafeReleaseNULL(properties);
+
+    return kIOReturnSuccess;
+}
+
+void VoodooI2CControllerDriver::completeChainedTransfer() {
+    VoodooI2CControllerTransfer* transfer = chained_transfer;
+
+    if (!transfer)
+        return;
+
+    chained_transfer = nullptr;
+    completeTransfer(transfer, chained_result);
+}
+
+void VoodooI2CControllerDriver::completeTransfer(VoodooI2CControllerTransfer* transfer, IOReturn result) {
+    AbsoluteTime now = mach_absolute_time();
+    UInt64 latency;
+
+    /* The next transfer may have ended synchronously, in which case the one chained before it goes first */
+    completeChainedTransfer();
+
+    if (active_transfer == transfer)
+        active_transfer = nullptr;
+    bus_device.statistics.queue_depth--;
+
+    if (result == kIOReturnSuccess)
+        bus_device.statistics.transfers_completed++;
+    else
+        bus_device.statistics.transfers_failed++;
+
+    absolutetime_to_nanoseconds(now - transfer->submit_time, &latency);
+    bus_device.statistics.latency_last_us = (UInt32)(latency / 1000);
+    if (bus_device.statistics.latency_last_us > bus_device.statistics.latency_max_us)
+        bus_device.statistics.latency_max_us = bus_device.statistics.latency_last_us;
+
+    transfer->result = result;
+    transfer->done = true;
+
+    if (transfer->completion) {
+        transfer->completion(transfer->context, result);
+    } else {
+        command_gate->commandWakeup(transfer);
+    }
+
+    if (transfer->allocated)
+        IOFree(transfer, sizeof(VoodooI2CControllerTransfer));
+}
+
+void VoodooI2CControllerDriver::handleAbortI2C() {
+    IOLog("%s::%s I2C Transaction error details\n", getName(), bus_device.name);
+
+    if (bus_device.state->abort_source & DW_IC_TX_ABRT_7B_ADDR_NOACK)
+        IOLog("%s::%s slave address not acknowledged (7bit mode)\n", getName(), bus_device.name);
+    if (bus_device.state->abort_source & DW_IC_TX_ABRT_10ADDR1_NOACK)
+        IOLog("%s::%s first address byte not acknowledged (10bit mode)\n", getName(), bus_device.name);
+    if (bus_device.state->abort_source & DW_IC_TX_ABRT_10ADDR2_NOACK)
+        IOLog("%s::%s second address byte not acknowledged (10bit mode)\n", getName(), bus_device.name);
+    if (bus_device.state->abort_source & DW_IC_TX_ABRT_TXDATA_NOACK)
+        IOLog("%s::%s data not acknowledged\n", getName(), bus_device.name);
+    if (bus_device.state->abort_source & DW_IC_TX_ABRT_GCALL_NOACK)
+        IOLog("%s::%s no acknowledgement for a general call\n", getName(), bus_device.name);
+    if (bus_device.state->abort_source & DW_IC_TX_ABRT_GCALL_READ)
+        IOLog("%s::%s read after general call\n", getName(), bus_device.name);
+    if (bus_device.state->abort_source & DW_IC_TX_ABRT_SBYTE_ACKDET)
+        IOLog("%s::%s start byte acknowledged\n", getName(), bus_device.name);
+    if (bus_device.state->abort_source & DW_IC_TX_ABRT_SBYTE_NORSTRT)
+        IOLog("%s::%s trying to send start byte when restart is disabled\n", getName(), bus_device.name);
+    if (bus_device.state->abort_source & DW_IC_TX_ABRT_10B_RD_NORSTRT)
+        IOLog("%s::%s trying to read when restart is disabled (10bit mode)\n", getName(), bus_device.name);
+    if (bus_device.state->abort_source & DW_IC_TX_ABRT_MASTER_DIS)
+        IOLog("%s::%s trying to use disabled adapter\n", getName(), bus_device.name);
+    if (bus_device.state->abort_source & DW_IC_TX_ARB_LOST)
+        IOLog("%s::%s lost arbitration\n", getName(), bus_device.name);
+
+    IOLog("%s::%s I2C Transaction error: 0x%08x - aborting\n", getName(), bus_device.name, bus_device.state->abort_source);
+}
+
+bool VoodooI2CControllerDriver::filterInterrupt(IOFilterInterruptEventSource* sender) {
+    /* Direct interrupt context. Do NOT block the thread by memory allocation, IOLog, IOLockLock, command_gate->runAction, ... */
+    UInt32 status;
+
+    /* A polled transfer is driven by the thread that started it */
+    if (!bus_device.state->awake || bus_device.state->polling || !bus_device.state->adapter_enabled || !bus_device.state->register_base)
+        return false;
+
+    /*
+     * The registers are accessed directly so that the access counters
+     * are only ever updated from the work loop.
+     *
+     * Only the unmasked interrupts are of interest, so there is no need to look at DW_IC_RAW_INTR_STAT.
+     */
+    status = *(volatile UInt32 *)(bus_device.state->register_base + DW_IC_INTR_STAT);
+
+    if (!status || status == 0xFFFFFFFF)
+        return false;
+
+    /* RX_FULL and TX_EMPTY follow the FIFO levels, so keep the controller quiet until the work loop has serviced it */
+    *(volatile UInt32 *)(bus_device.state->register_base + DW_IC_INTR_MASK) = 0;
+
+    bus_device.state->pending_status = status;
+
+    if (status & DW_IC_INTR_STOP_DET)
+        bus_device.state->transfer_stopped = mach_absolute_time();
+
+    return true;
+}
+
+void VoodooI2CControllerDriver::handleInterrupt(OSObject* owner, IOInterruptEventSource* src, int count) {
+    UInt32 status = bus_device.state->pending_status;
+
+    bus_device.state->pending_status = 0;
+
+    /* The filter has masked the controller behind the shadow's back, so the next write must reach the hardware */
+    shadow_valid &= ~BIT(DW_IC_INTR_MASK >> 2);
+
+    /* The transfer may have been ended by its timeout in the meantime */
+    if (!status || !active_transfer || bus_device.state->command_complete)
+        return;
+
+    bus_device.statistics.interrupts++;
+
+#ifdef DEBUG
+    UInt32 accesses = bus_device.statistics.register_accesses;
+#endif
+
+    bus_device.state->servicing = true;
+    serviceTransfer(status);
+    bus_device.state->servicing = false;
+
+    /*
+     * Going through a zero mask also retriggers pending interrupts on
+     * controllers that need the AccessIntrMaskWorkaround.
+     */
+    if (!bus_device.state->command_complete)
+        writeShadowedRegister(bus_device.state->interrupt_mask, DW_IC_INTR_MASK);
+
+#ifdef DEBUG
+    /* The filter has read DW_IC_INTR_STAT and written DW_IC_INTR_MASK */
+    bus_device.statistics.interrupt_register_accesses += 2 + bus_device.statistics.register_accesses - accesses;
+#endif
+
+    if (bus_device.state->command_complete)
+        handleTransferComplete();
+}
+
+bool VoodooI2CControllerDriver::init(OSDictionary* properties) {
+    if (!super::init(properties))
+        return false;
+
+    memset(&bus_device, 0, sizeof(VoodooI2CControllerBusDevice));
+
+    bus_device.state = reinterpret_cast<VoodooI2CControllerTransferState*>(IOMallocAligned(sizeof(VoodooI2CControllerTransferState), VOODOOI2C_CACHE_LINE_SIZE));
+
+    if (!bus_device.state)
+        return false;
+
+    memset(bus_device.state, 0, sizeof(VoodooI2CControllerTransferState));
+    bus_device.state->awake = true;
+
+    device_nubs = OSArray::withCapacity(1);
+
+    return true;
+}
+
+IOReturn VoodooI2CControllerDriver::initialiseBus() {
+    if (toggleBusState(kVoodooI2CStateOff) != kIOReturnSuccess)
+        return kIOReturnError;
+
+    invalidateShadowRegisters();
+
+    writeShadowedRegister(bus_device.acpi_config.ss_hcnt, DW_IC_SS_SCL_HCNT);
+    writeShadowedRegister(bus_device.acpi_config.ss_lcnt, DW_IC_SS_SCL_LCNT);
+    /* Fast-mode Plus shares the fast mode registers */
+    if (bus_device.current_speed == I2C_MAX_FAST_MODE_PLUS_FREQ) {
+        writeShadowedRegister(bus_device.acpi_config.fp_hcnt, DW_IC_FS_SCL_HCNT);
+        writeShadowedRegister(bus_device.acpi_config.fp_lcnt, DW_IC_FS_SCL_LCNT);
+    } else {
+        writeShadowedRegister(bus_device.acpi_config.fs_hcnt, DW_IC_FS_SCL_HCNT);
+        writeShadowedRegister(bus_device.acpi_config.fs_lcnt, DW_IC_FS_SCL_LCNT);
+    }
+    if (bus_device.high_speed_capable && bus_device.acpi_config.hs_hcnt) {
+        writeShadowedRegister(bus_device.acpi_config.hs_hcnt, DW_IC_HS_SCL_HCNT);
+        writeShadowedRegister(bus_device.acpi_config.hs_lcnt, DW_IC_HS_SCL_LCNT);
+    }
+    if (bus_device.acpi_config.sda_hold) {
+        writeRegister(bus_device.acpi_config.sda_hold, DW_IC_SDA_HOLD);
+    }
+    bus_device.state->bus_idle = false;
+    writeShadowedRegister(bus_device.transaction_fifo_depth / 2, DW_IC_TX_TL);
+    writeShadowedRegister(0, DW_IC_RX_TL);
+    writeShadowedRegister(bus_device.bus_config, DW_IC_CON);
+
+    /* The iDMA comes out of reset disabled, as it does after a wake */
+    if (dma_buffer)
+        writeRegister(IDMA64_CFG_DMA_EN, IDMA64_CFG);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooI2CControllerDriver::initialiseDMA() {
+    dma_buffer = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIODirectionInOut | kIOMemoryPhysicallyContiguous, IDMA_BUFFER_SIZE, 0xFFFFF000ULL);
+    if (!dma_buffer)
+        return kIOReturnNoMemory;
+
+    if (dma_buffer->prepare() != kIOReturnSuccess) {
+        OSSafeReleaseNULL(dma_buffer);
+        return kIOReturnNoMemory;
+    }
+
+    /*
+     * The channels must be given the address the buffer has on the bus. With VT-d enabled that is not the
+     * physical address, so the buffer is mapped through the system mapper.
+     */
+    IODMACommand::Segment64 segment;
+    UInt32 segments = 1;
+    UInt64 offset = 0;
+
+    dma_command = IODMACommand::withSpecification(kIODMACommandOutputHost64, 32, IDMA_BUFFER_SIZE, IODMACommand::kMapped, IDMA_BUFFER_SIZE);
+    if (!dma_command || dma_command->setMemoryDescriptor(dma_buffer) != kIOReturnSuccess ||
+        dma_command->gen64IOVMSegments(&offset, &segment, &segments) != kIOReturnSuccess || segments != 1 || segment.fLength < IDMA_BUFFER_SIZE) {
+        releaseDMA();
+        return kIOReturnNoMemory;
+    }
+
+    dma_buffer_address = segment.fIOVMAddr;
+
+    return kIOReturnSuccess;
+}
+
+void VoodooI2CControllerDriver::invalidateShadowRegisters() {
+    shadow_valid = 0;
+}
+
+IOReturn VoodooI2CControllerDriver::finishTransferDMA() {
+    VoodooI2CControllerBusMessage* messages = bus_device.state->messages;
+    UInt8* received = reinterpret_cast<UInt8*>(dma_buffer->getBytesNoCopy()) + IDMA_RX_OFFSET;
+    bool drain = bus_device.state->command_complete && !bus_device.state->command_error;
+    IOReturn ret = kIOReturnSuccess;
+    int timeout = 100;
+
+    /* STOP_DET can overtake the RX channel by the last few bytes, an aborted run is simply cut short */
+    while (drain && (readRegister(IDMA64_CH_EN) & BIT(IDMA64_RX_CHANNEL))) {
+        if (!timeout--) {
+            ret = kIOReturnTimeout;
+            break;
+        }
+        IODelay(1);
+    }
+
+    stopTransferDMA();
+    bus_device.state->dma = false;
+
+    if (!drain || ret != kIOReturnSuccess)
+        return ret;
+
+    dma_command->synchronize(kIODirectionIn);
+
+    for (int i = 0; i < bus_device.state->message_number; i++) {
+        if (messages[i].flags & I2C_M_RD)
+            memcpy(messages[i].buffer, received, messages[i].length);
+    }
+
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooI2CControllerDriver::finishTransferI2C() {
+    /*
+     * We must disable the adapter before returning and signalling the end
+     * of the current transfer. Otherwise the hardware might continue
+     * generating interrupts which in turn causes a race condition with
+     * the following transfer.  Needs some more investigation if the
+     * additional interrupts are a hardware bug or this driver doesn't
+     * handle them correctly yet.
+     *
+     * With I2C_DYNAMIC_TAR_UPDATE we keep the adapter enabled after a
+     * clean transfer and only mask its interrupts, so the next transfer
+     * does not have to go through a full disable/enable cycle.
+     *
+     * A polled transfer only ever touched the software interrupt mask,
+     * leave polling first so that the hardware mask is cleared as well.
+     */
+    bus_device.state->polling = false;
+
+    if (bus_device.state->dma && finishTransferDMA() != kIOReturnSuccess)
+        bus_device.state->message_error = -1;
+
+    if (canKeepAdapterEnabled() && !bus_device.state->message_error && !bus_device.state->command_error && !bus_device.state->quick_command)
+        toggleInterrupts(kVoodooI2CStateOff);
+    else
+        toggleBusState(kVoodooI2CStateOff);
+
+    /* A clean transfer ends on our own STOP, which leaves the bus idle for the next one */
+    bus_device.state->bus_idle = !bus_device.state->message_error && !bus_device.state->command_error;
+
+    if (bus_device.state->message_error)
+        return kIOReturnError;
+
+    if (!bus_device.state->command_error) {
+        sampleBusTiming();
+
+        /* Length-prefixed reads report how much was received, now that the run can no longer be retried */
+        for (int i = 0; i < bus_device.state->message_number; i++) {
+            if (I2C_M_RECV_LEN_HEADER(bus_device.state->messages[i].flags))
+                bus_device.state->messages[i].length = getReceiveLength(&bus_device.state->messages[i]);
+        }
+
+        return kIOReturnSuccess;
+    }
+
+    if (bus_device.state->command_error == DW_IC_ERR_TX_ABRT) {
+        /* An unanswered quick command is how a probe finds an address unused, not an error */
+        if ((bus_device.state->quick_command || bus_device.state->probe_read) && (bus_device.state->abort_source & DW_IC_TX_ABRT_NOACK))
+            return kIOReturnNoDevice;
+
+        handleAbortI2C();
+        return kIOReturnError;
+    }
+
+    return kIOReturnNotReady;
+}
+
+void VoodooI2CControllerDriver::handleTransferComplete() {
+    VoodooI2CControllerTransfer* transfer = active_transfer;
+
+    timeout_source->cancelTimeout();
+
+    IOReturn ret = finishTransferI2C();
+
+    if ((ret == kIOReturnNotReady && transfer->tries++ < 5) || (ret == kIOReturnSuccess && nextTransferRun(transfer))) {
+        runTransfer(transfer);
+    } else if (transfer_queue_head) {
+        /* Put the bus to work on the next transfer first, this one is handed back once that has been started */
+        active_transfer = nullptr;
+        chained_transfer = transfer;
+        chained_result = ret;
+        bus_device.statistics.transfers_chained++;
+    } else {
+        completeTransfer(transfer, ret);
+    }
+
+    startNextTransfer();
+
+    completeChainedTransfer();
+}
+
+void VoodooI2CControllerDriver::handleTransferTimeout(OSObject* owner, IOTimerEventSource* timer) {
+    VoodooI2CControllerTransfer* transfer = active_transfer;
+
+    if (!transfer)
+        return;
+
+    if (idle_wait_pending) {
+        idle_wait_pending = false;
+        runTransfer(transfer);
+        startNextTransfer();
+        return;
+    }
+
+    UInt64 elapsed;
+
+    IOLog("%s::%s Timeout waiting for bus to accept transfer request\n", getName(), bus_device.name);
+    if (bus_device.state->dma)
+        finishTransferDMA();
+    initialiseBus();
+
+    absolutetime_to_nanoseconds(mach_absolute_time() - transfer_started, &elapsed);
+    bus_device.statistics.recovery_latency_last_us = (UInt32)(elapsed / 1000);
+    bus_device.statistics.transfers_timed_out++;
+
+    completeTransfer(transfer, kIOReturnTimeout);
+
+    startNextTransfer();
+}
+
+IOReturn VoodooI2CControllerDriver::startTransferI2C(VoodooI2CControllerTransfer* transfer) {
+    VoodooI2CControllerBusMessage* messages;
+    UInt64 estimate;
+    IOReturn ret;
+
+    if (!bus_device.state->awake)
+        return kIOReturnBusy;
+
+    active_transfer = transfer;
+    bus_device.state->command_complete = false;
+
+    ret = waitBusNotBusyI2C();
+    if (ret == kIOReturnNotReady) {
+        /* Nothing to do until the bus had time to go idle, the transfer is restarted from handleTransferTimeout */
+        idle_wait_pending = true;
+        timeout_source->setTimeoutUS(getBusIdleInterval());
+        return kIOReturnSuccess;
+    }
+
+    if (ret != kIOReturnSuccess)
+        return kIOReturnBusy;
+
+    setBusSpeed(getTransferBusSpeed(transfer->speed));
+
+    /* Drop whatever the filter captured for a transfer that has since been ended by its timeout */
+    bus_device.state->pending_status = 0;
+
+    /*
+     * The controller can only talk to one slave device per STOP, so the
+     * transfer is carried out as runs of messages for the same address.
+     * DW_IC_TAR is reprogrammed at the start of every run.
+     */
+    messages = &transfer->messages[transfer->run_start];
+    for (transfer->run_length = 1; transfer->run_start + transfer->run_length < transfer->number; transfer->run_length++) {
+        VoodooI2CControllerBusMessage* message = &messages[transfer->run_length];
+        if (message->address != messages[0].address || (message->flags & I2C_M_TEN) != (messages[0].flags & I2C_M_TEN))
+            break;
+    }
+
+    bus_device.state->bus_idle = false;
+    bus_device.state->messages = messages;
+    bus_device.state->message_number = transfer->run_length;
+    /*
+     * IC_TAR's SMBus quick command bits only exist on cores built with IC_SMBUS, elsewhere setting SPECIAL sends a
+     * General Call. Without declared support a lone zero-length read is probed with a single byte instead.
+     */
+    bus_device.state->quick_command = transfer->run_length == 1 && messages[0].length == 0 &&
+        (bus_device.functionality & I2C_FUNC_SMBUS_QUICK);
+    bus_device.state->probe_read = transfer->run_length == 1 && messages[0].length == 0 &&
+        !bus_device.state->quick_command && (messages[0].flags & I2C_M_RD);
+    bus_device.state->command_error = 0;
+    bus_device.state->message_write_index = 0;
+    bus_device.state->message_read_index = 0;
+    bus_device.state->message_error = 0;
+    bus_device.state->status = STATUS_IDLE;
+    bus_device.state->abort_source = 0;
+    bus_device.state->receive_outstanding = 0;
+    bus_device.state->receive_length_index = -1;
+    bus_device.state->transaction_commands = 0;
+
+    /* Length-prefixed reads only issue their header up front */
+    for (int i = 0; i < transfer->run_length; i++) {
+        UInt32 header = I2C_M_RECV_LEN_HEADER(messages[i].flags);
+        bus_device.state->transaction_commands += header ? header : messages[i].length;
+    }
+
+    if (bus_device.state->quick_command || bus_device.state->probe_read)
+        bus_device.state->transaction_commands = 1;
+
+    bus_device.state->dma = canTransferDMA(messages, transfer->run_length);
+
+    estimate = estimateTransferTime(messages, transfer->run_length);
+    transfer_started = mach_absolute_time();
+    bus_device.state->transfer_stopped = 0;
+    calibration.run_started = 0;
+    bus_device.state->polling = !bus_device.state->dma && estimate <= (UInt64)polled_transfer_budget * 1000;
+
+    requestTransferI2C();
+
+    if (bus_device.state->polling) {
+        if (pollTransferI2C(estimate) == kIOReturnSuccess) {
+            bus_device.statistics.transfers_polled++;
+            return kIOReturnSuccess;
+        }
+
+        bus_device.statistics.polled_fallbacks++;
+    } else {
+        bus_device.statistics.transfers_interrupt++;
+    }
+
+    /*
+     * Timeout to prevent the caller from deadlock. Twice the estimated
+     * bus time covers slow edges and FIFO refills, the allowance covers
+     * slaves stretching the clock :
+     *   10ms is required, for example, when reading the HID descriptor for the first time.
+     */
+    timeout_source->setTimeoutUS(getTransferTimeout(estimate));
+
+    return kIOReturnSuccess;
+}
+
+void VoodooI2CControllerDriver::startNextTransfer() {
+    while (!active_transfer && transfer_queue_head) {
+        VoodooI2CControllerTransfer* transfer = transfer_queue_head;
+
+        transfer_queue_head = transfer->next;
+        if (!transfer_queue_head)
+            transfer_queue_tail = nullptr;
+        transfer->next = nullptr;
+
+        runTransfer(transfer);
+    }
+
+    if (!active_transfer) {
+        AbsoluteTime now = mach_absolute_time();
+        UInt64 elapsed;
+
+        /* Publishing allocates, so only refresh the statistics about once a second while the queue is idle */
+        absolutetime_to_nanoseconds(now - statistics_published, &elapsed);
+        if (elapsed > 1000000000) {
+            setBusStatisticsProperties();
+            statistics_published = now;
+        }
+
+        command_gate->commandWakeup(&active_transfer);
+    }
+}
+
+void VoodooI2CControllerDriver::startChannelDMA(UInt32 channel, UInt64 source, UInt64 destination, UInt32 control, UInt32 length, UInt32 config) {
+    writeRegister((UInt32)source, IDMA64_CH(channel, IDMA64_CH_SAR));
+    writeRegister((UInt32)(source >> 32), IDMA64_CH(channel, IDMA64_CH_SAR) + 4);
+    writeRegister((UInt32)destination, IDMA64_CH(channel, IDMA64_CH_DAR));
+    writeRegister((UInt32)(destination >> 32), IDMA64_CH(channel, IDMA64_CH_DAR) + 4);
+    writeRegister(0, IDMA64_CH(channel, IDMA64_CH_LLP));
+    writeRegister(control, IDMA64_CH(channel, IDMA64_CH_CTL_LO));
+    writeRegister(IDMA64C_CTLH_BLOCK_TS(length), IDMA64_CH(channel, IDMA64_CH_CTL_HI));
+    writeRegister(0, IDMA64_CH(channel, IDMA64_CH_CFG_LO));
+    writeRegister(config, IDMA64_CH(channel, IDMA64_CH_CFG_HI));
+
+    /* The upper byte selects which enable bits the write applies to */
+    writeRegister((BIT(channel) << 8) | BIT(channel), IDMA64_CH_EN);
+}
+
+void VoodooI2CControllerDriver::startTransferDMA() {
+    VoodooI2CControllerBusMessage* messages = bus_device.state->messages;
+    UInt32* commands = reinterpret_cast<UInt32*>(dma_buffer->getBytesNoCopy());
+    UInt64 data_command = nub->controller->physical_device.mmap->getPhysicalAddress() + DW_IC_DATA_CMD;
+    UInt32 count = 0, receive_length = 0;
+
+    for (int i = 0; i < bus_device.state->message_number; i++) {
+        for (UInt32 j = 0; j < messages[i].length; j++) {
+            UInt32 command = (messages[i].flags & I2C_M_RD) ? 0x100 : messages[i].buffer[j];
+
+            if (i > 0 && j == 0 && (bus_device.bus_config & DW_IC_CON_RESTART_EN))
+                command |= 0x400;
+            commands[count++] = command;
+        }
+
+        if (messages[i].flags & I2C_M_RD)
+            receive_length = messages[i].length;
+    }
+    commands[count - 1] |= 0x200;
+
+    /* Nothing is left for the FIFO handlers, the run ends on STOP_DET or TX_ABRT */
+    bus_device.state->message_write_index = bus_device.state->message_number;
+    bus_device.state->message_read_index = bus_device.state->message_number;
+
+    bus_device.statistics.transfers_dma++;
+    bus_device.statistics.dma_commands += count;
+
+    if (receive_length)
+        startChannelDMA(IDMA64_RX_CHANNEL, data_command, dma_buffer_address + IDMA_RX_OFFSET,
+                        IDMA64C_CTLL_DST_WIDTH(0) | IDMA64C_CTLL_SRC_WIDTH(0) | IDMA64C_CTLL_SRC_FIX | IDMA64C_CTLL_FC_P2M,
+                        receive_length, IDMA64C_CFGH_SRC_PER(IDMA64_RX_CHANNEL));
+
+    startChannelDMA(IDMA64_TX_CHANNEL, dma_buffer_address, data_command,
+                    IDMA64C_CTLL_DST_WIDTH(2) | IDMA64C_CTLL_SRC_WIDTH(2) | IDMA64C_CTLL_DST_FIX | IDMA64C_CTLL_FC_M2P,
+                    count, IDMA64C_CFGH_DST_PER(IDMA64_TX_CHANNEL));
+
+    dma_command->synchronize(kIODirectionOut);
+
+    writeRegister(bus_device.transaction_fifo_depth / 2, DW_IC_DMA_TDLR);
+    writeRegister(0, DW_IC_DMA_RDLR);
+
+    readRegister(DW_IC_CLR_INTR);
+    setInterruptMask(DW_IC_INTR_TX_ABRT | DW_IC_INTR_STOP_DET);
+
+    writeRegister(DW_IC_DMA_CR_TDMAE | (receive_length ? DW_IC_DMA_CR_RDMAE : 0), DW_IC_DMA_CR);
+}
+
+void VoodooI2CControllerDriver::stopTransferDMA() {
+    writeRegister(0, DW_IC_DMA_CR);
+    writeRegister((BIT(IDMA64_TX_CHANNEL) | BIT(IDMA64_RX_CHANNEL)) << 8, IDMA64_CH_EN);
+}
+
+void VoodooI2CControllerDriver::startTransferInterrupts() {
+    /* Polled transfers keep the interrupts masked and work off the software mask */
+    if (bus_device.state->polling) {
+        readRegister(DW_IC_CLR_INTR);
+        bus_device.state->interrupt_mask = DW_IC_INTR_DEFAULT_MASK;
+        calibration.run_started = mach_absolute_time();
+        transferMessageToBus();
+        return;
+    }
+
+    if (bus_device.state->dma) {
+        startTransferDMA();
+        return;
+    }
+
+    /*
+     * The mask is rewritten from the interrupt handler on AMD controllers
+     * (see DW_IC_QUIRK_ACCESS_INTR_MASK), so only prefill where nothing
+     * else writes it before transferMessageToBus does.
+     */
+    if (bus_device.state->transaction_commands > bus_device.transaction_fifo_depth ||
+        (bus_device.quirks & DW_IC_QUIRK_ACCESS_INTR_MASK)) {
+        toggleInterrupts(kVoodooI2CStateOn);
+        return;
+    }
+
+    bus_device.statistics.transfers_prefilled++;
+
+    readRegister(DW_IC_CLR_INTR);
+    calibration.run_started = mach_absolute_time();
+    transferMessageToBus();
 }
 
-void VoodooI2CControllerDriver::handleAbortI2C() {
-    IOLog("%s::%s I2C Transaction error details\n", getName(), bus_device.name);
-
-    if (bus_device.abort_source & DW_IC_TX_ABRT_7B_ADDR_NOACK)
-        IOLog("%s::%s slave address not acknowledged (7bit mode)\n", getName(), bus_device.name);
-    if (bus_device.abort_source & DW_IC_TX_ABRT_10ADDR1_NOACK)
-        IOLog("%s::%s first address byte not acknowledged (10bit mode)\n", getName(), bus_device.name);
-    if (bus_device.abort_source & DW_IC_TX_ABRT_10ADDR2_NOACK)
-        IOLog("%s::%s second address byte not acknowledged (10bit mode)\n", getName(), bus_device.name);
-    if (bus_device.abort_source & DW_IC_TX_ABRT_TXDATA_NOACK)
-        IOLog("%s::%s data not acknowledged\n", getName(), bus_device.name);
-    if (bus_device.abort_source & DW_IC_TX_ABRT_GCALL_NOACK)
-        IOLog("%s::%s no acknowledgement for a general call\n", getName(), bus_device.name);
-    if (bus_device.abort_source & DW_IC_TX_ABRT_GCALL_READ)
-        IOLog("%s::%s read after general call\n", getName(), bus_device.name);
-    if (bus_device.abort_source & DW_IC_TX_ABRT_SBYTE_ACKDET)
-        IOLog("%s::%s start byte acknowledged\n", getName(), bus_device.name);
-    if (bus_device.abort_source & DW_IC_TX_ABRT_SBYTE_NORSTRT)
-        IOLog("%s::%s trying to send start byte when restart is disabled\n", getName(), bus_device.name);
-    if (bus_device.abort_source & DW_IC_TX_ABRT_10B_RD_NORSTRT)
-        IOLog("%s::%s trying to read when restart is disabled (10bit mode)\n", getName(), bus_device.name);
-    if (bus_device.abort_source & DW_IC_TX_ABRT_MASTER_DIS)
-        IOLog("%s::%s trying to use disabled adapter\n", getName(), bus_device.name);
-    if (bus_device.abort_source & DW_IC_TX_ARB_LOST)
-        IOLog("%s::%s lost arbitration\n", getName(), bus_device.name);
+bool VoodooI2CControllerDriver::nextTransferRun(VoodooI2CControllerTransfer* transfer) {
+    transfer->run_start += transfer->run_length;
+    transfer->run_length = 0;
+    transfer->tries = 0;
 
-    IOLog("%s::%s I2C Transaction error: 0x%08x - aborting\n", getName(), bus_device.name, bus_device.abort_source);
+    return transfer->run_start < transfer->number;
 }
 
-void VoodooI2CControllerDriver::handleInterrupt(OSObject* target, void* refCon, IOService* nubDevice, int source) {
-    /* Direct interrupt context. Do NOT block the thread by memory allocation, IOLog, IOLockLock, command_gate->runAction, ... */
-    nub->disableInterrupt(0);
+IOReturn VoodooI2CControllerDriver::pollTransferI2C(UInt64 estimate) {
+    AbsoluteTime deadline;
 
-    UInt32 status, enabled;
+    /* Allow for twice the estimated bus time plus a little clock stretching before giving up on polling */
+    nanoseconds_to_absolutetime(estimate * 2 + 20000, &deadline);
+    deadline += mach_absolute_time();
 
-    if (!bus_device.awake) {
-        goto exit;
-    }
+    /* The hardware mask stays zero while polling, so apply the software mask to the raw status instead */
+    do {
+        UInt32 status = readRegister(DW_IC_RAW_INTR_STAT) & bus_device.state->interrupt_mask;
 
-    enabled = readRegister(DW_IC_ENABLE);
-    status = readRegister(DW_IC_RAW_INTR_STAT);
+        if (status & DW_IC_INTR_STOP_DET)
+            bus_device.state->transfer_stopped = mach_absolute_time();
 
-    if (!enabled || !(status &~DW_IC_INTR_ACTIVITY) || status == 0xFFFFFFFF)
-        goto exit;
+        serviceTransfer(status);
+        if (bus_device.state->command_complete)
+            return kIOReturnSuccess;
+    } while (mach_absolute_time() < deadline);
 
-    status = readClearInterruptBits();
+    /* Hand the rest of the transfer over to the interrupt handler */
+    bus_device.state->polling = false;
+    writeShadowedRegister(bus_device.state->interrupt_mask, DW_IC_INTR_MASK);
 
-    if (status & DW_IC_INTR_TX_ABRT) {
-        bus_device.command_error |= DW_IC_ERR_TX_ABRT;
-        bus_device.status = STATUS_IDLE;
-        bus_device.receive_outstanding = 0;
+    return kIOReturnTimeout;
+}
 
-        writeRegister(0, DW_IC_INTR_MASK);
-        goto wakeup;
-    }
+void VoodooI2CControllerDriver::runTransfer(VoodooI2CControllerTransfer* transfer) {
+    IOReturn ret;
 
-    if (status & DW_IC_INTR_RX_FULL)
-        readFromBus();
+    do {
+        ret = startTransferI2C(transfer);
 
-    if (status & DW_IC_INTR_TX_EMPTY)
-        transferMessageToBus();
+        /* Still in flight, the transfer ends in handleTransferComplete or handleTransferTimeout */
+        if (ret == kIOReturnSuccess && !bus_device.state->command_complete)
+            return;
 
-wakeup:
-    if (((status & (DW_IC_INTR_TX_ABRT | DW_IC_INTR_STOP_DET)) || bus_device.message_error) && (bus_device.receive_outstanding == 0)) {
-        command_gate->commandWakeup(&bus_device.command_complete);
-    } else if (nub->controller->physical_device.access_intr_mask_workaround) {
-        /* Workaround to trigger pending interrupt */
-        status = readRegister(DW_IC_INTR_MASK);
-        writeRegister(0, DW_IC_INTR_MASK);
-        writeRegister(status, DW_IC_INTR_MASK);
-    }
+        if (ret == kIOReturnSuccess)
+            ret = finishTransferI2C();
+    } while ((ret == kIOReturnNotReady && transfer->tries++ < 5) || (ret == kIOReturnSuccess && nextTransferRun(transfer)));
 
-exit:
-    nub->enableInterrupt(0);
+    completeTransfer(transfer, ret);
 }
 
-bool VoodooI2CControllerDriver::init(OSDictionary* properties) {
-    if (!super::init(properties))
-        return false;
+void VoodooI2CControllerDriver::serviceTransfer(UInt32 status) {
+    /*
+     * Acknowledging the abort releases the flushed TX FIFO, the TX channel
+     * would then feed the rest of the command list to the bus as a new write.
+     */
+    if ((status & DW_IC_INTR_TX_ABRT) && bus_device.state->dma)
+        stopTransferDMA();
 
-    memset(&bus_device, 0, sizeof(VoodooI2CControllerBusDevice));
-    bus_device.awake = true;
+    clearInterruptBits(status);
 
-    device_nubs = OSArray::withCapacity(1);
+    if (status & DW_IC_INTR_TX_ABRT) {
+        bus_device.state->command_error |= DW_IC_ERR_TX_ABRT;
+        bus_device.state->status = STATUS_IDLE;
+        bus_device.state->receive_outstanding = 0;
 
-    return true;
-}
+        setInterruptMask(0);
+    } else if ((status & DW_IC_INTR_STOP_DET) && bus_device.state->message_write_index < bus_device.state->message_number) {
+        /*
+         * Without IC_EMPTYFIFO_HOLD_MASTER_EN the controller sends STOP on its
+         * own once the TX FIFO runs empty, so the run ended before all of its
+         * commands went out. Refilling now would start a new transfer.
+         */
+        bus_device.state->message_error = -1;
+        bus_device.state->status = STATUS_IDLE;
+        bus_device.state->receive_outstanding = 0;
 
-IOReturn VoodooI2CControllerDriver::initialiseBus() {
-    if (toggleBusState(kVoodooI2CStateOff) != kIOReturnSuccess)
-        return kIOReturnError;
+        setInterruptMask(0);
+    } else {
+        if (status & DW_IC_INTR_RX_FULL) {
+            bus_device.statistics.receive_interrupts++;
+            readFromBus();
+        }
 
-    writeRegister(bus_device.acpi_config.ss_hcnt, DW_IC_SS_SCL_HCNT);
-    writeRegister(bus_device.acpi_config.ss_lcnt, DW_IC_SS_SCL_LCNT);
-    writeRegister(bus_device.acpi_config.fs_hcnt, DW_IC_FS_SCL_HCNT);
-    writeRegister(bus_device.acpi_config.fs_lcnt, DW_IC_FS_SCL_LCNT);
-    if (bus_device.acpi_config.sda_hold) {
-        writeRegister(bus_device.acpi_config.sda_hold, DW_IC_SDA_HOLD);
+        /* TX_EMPTY is masked while read commands are throttled, so refill as soon as the RX FIFO has been drained */
+        if ((status & DW_IC_INTR_TX_EMPTY) || ((status & DW_IC_INTR_RX_FULL) && bus_device.state->message_write_index < bus_device.state->message_number))
+            transferMessageToBus();
     }
-    writeRegister(bus_device.transaction_fifo_depth / 2, DW_IC_TX_TL);
-    writeRegister(0, DW_IC_RX_TL);
-    writeRegister(bus_device.bus_config, DW_IC_CON);
 
-    return kIOReturnSuccess;
+    if (((status & (DW_IC_INTR_TX_ABRT | DW_IC_INTR_STOP_DET)) || bus_device.state->message_error) && (bus_device.state->receive_outstanding == 0))
+        bus_device.state->command_complete = true;
 }
 
-IOReturn VoodooI2CControllerDriver::prepareTransferI2C(VoodooI2CControllerBusMessage* messages, int* number) {
-    AbsoluteTime abstime, deadline;
-    IOReturn sleep;
+void VoodooI2CControllerDriver::setBusSpeed(UInt32 speed) {
+    if (speed == bus_device.current_speed)
+        return;
 
-    if (!bus_device.awake || waitBusNotBusyI2C() != kIOReturnSuccess) {
-        return kIOReturnBusy;
+    toggleBusState(kVoodooI2CStateOff);
+
+    bus_device.current_speed = speed;
+    bus_device.bus_config = (bus_device.bus_config & ~DW_IC_CON_SPEED_MASK) | getSpeedConfig(speed);
+
+    if (speed == I2C_MAX_FAST_MODE_PLUS_FREQ) {
+        writeShadowedRegister(bus_device.acpi_config.fp_hcnt, DW_IC_FS_SCL_HCNT);
+        writeShadowedRegister(bus_device.acpi_config.fp_lcnt, DW_IC_FS_SCL_LCNT);
+    } else if (speed == I2C_MAX_FAST_MODE_FREQ) {
+        writeShadowedRegister(bus_device.acpi_config.fs_hcnt, DW_IC_FS_SCL_HCNT);
+        writeShadowedRegister(bus_device.acpi_config.fs_lcnt, DW_IC_FS_SCL_LCNT);
+    } else if (speed == I2C_MAX_STANDARD_MODE_FREQ) {
+        writeShadowedRegister(bus_device.acpi_config.ss_hcnt, DW_IC_SS_SCL_HCNT);
+        writeShadowedRegister(bus_device.acpi_config.ss_lcnt, DW_IC_SS_SCL_LCNT);
     }
 
-    bus_device.messages = messages;
-    bus_device.message_number = *number;
-    bus_device.command_error = 0;
-    bus_device.message_write_index = 0;
-    bus_device.message_read_index = 0;
-    bus_device.message_error = 0;
-    bus_device.status = STATUS_IDLE;
-    bus_device.abort_source = 0;
-    bus_device.receive_outstanding = 0;
+    /* requestTransferI2C restores the addressing mode from here since the adapter is now disabled */
+    writeShadowedRegister(bus_device.bus_config, DW_IC_CON);
+}
 
-    requestTransferI2C();
+void VoodooI2CControllerDriver::setInterruptMask(UInt32 mask) {
+    bus_device.state->interrupt_mask = mask;
 
-    /*
-     * Sleep timeout to prevent the caller from deadlock :
-     *   10ms is required, for example, when reading the HID descriptor for the first time.
-     *   Timeout is set to 100ms (10ms x 10 times)
-     */
-    nanoseconds_to_absolutetime(1000000000, &abstime);
-    clock_absolutetime_interval_to_deadline(abstime, &deadline);
-    sleep = command_gate->commandSleep(&bus_device.command_complete, deadline, THREAD_INTERRUPTIBLE);
+    if (!bus_device.state->polling && !bus_device.state->servicing)
+        writeShadowedRegister(mask, DW_IC_INTR_MASK);
+}
 
-    if (sleep == THREAD_TIMED_OUT) {
-        IOLog("%s::%s Timeout waiting for bus to accept transfer request\n", getName(), bus_device.name);
-        initialiseBus();
-        return kIOReturnTimeout;
-    }
+IOReturn VoodooI2CControllerDriver::submitTransferGated(VoodooI2CControllerTransfer* transfer) {
+    /* A client resubmitting from its completion would otherwise keep the queue from ever draining for sleep */
+    if (sleep_pending)
+        return kIOReturnBusy;
 
-    /*
-     * We must disable the adapter before returning and signalling the end
-     * of the current transfer. Otherwise the hardware might continue
-     * generating interrupts which in turn causes a race condition with
-     * the following transfer.  Needs some more investigation if the
-     * additional interrupts are a hardware bug or this driver doesn't
-     * handle them correctly yet.
-     */
-    toggleBusState(kVoodooI2CStateOff);
+    transfer->submit_time = mach_absolute_time();
 
-    if (bus_device.message_error)
-        return kIOReturnError;
+    if (transfer_queue_tail)
+        transfer_queue_tail->next = transfer;
+    else
+        transfer_queue_head = transfer;
+    transfer_queue_tail = transfer;
 
-    if (!bus_device.command_error)
-        return kIOReturnSuccess;
+    if (++bus_device.statistics.queue_depth > bus_device.statistics.queue_depth_max)
+        bus_device.statistics.queue_depth_max = bus_device.statistics.queue_depth;
 
-    if (bus_device.command_error == DW_IC_ERR_TX_ABRT) {
-        handleAbortI2C();
-        return kIOReturnError;
-    }
+    startNextTransfer();
 
-    return kIOReturnNotReady;
+    return kIOReturnSuccess;
 }
 
 VoodooI2CControllerDriver* VoodooI2CControllerDriver::probe(IOService* provider, SInt32* score) {
@@ -342,6 +1268,11 @@ VoodooI2CControllerDriver* VoodooI2CControllerDriver::probe(IOService* provider,
 
     bus_device.name = nub->name;
 
+    bus_device.quirks = getControllerQuirks(&nub->controller->physical_device, &bus_device.clock_rate);
+    /* The personalities opt into this one through AccessIntrMaskWorkaround, so the table never sets it */
+    if (nub->controller->physical_device.access_intr_mask_workaround)
+        bus_device.quirks |= DW_IC_QUIRK_ACCESS_INTR_MASK;
+
     IOLog("%s::%s Probing controller\n", getName(), bus_device.name);
 
     reg = readRegister(DW_IC_COMP_TYPE);
@@ -361,9 +1292,13 @@ IOReturn VoodooI2CControllerDriver::publishNubs() {
 
     IOService* child;
     OSIterator* children = nub->controller->physical_device.acpi_device->getChildIterator(gIOACPIPlane);
+    OSArray* attached_nubs = OSArray::withCapacity(1);
 
-    if (!children)
+    if (!children || !attached_nubs) {
+        OSSafeReleaseNULL(children);
+        OSSafeReleaseNULL(attached_nubs);
         return kIOReturnNoResources;
+    }
 
     while ((child = OSDynamicCast(IOService, children->getNextObject()))) {
         IOLog("%s::%s Found I2C device: %s\n", getName(), bus_device.name, getMatchedName(child));
@@ -375,11 +1310,16 @@ IOReturn VoodooI2CControllerDriver::publishNubs() {
             !device_nub->init(child_properties) ||
             !device_nub->attach(this, child)) {
             IOLog("%s::%s Could not initialise nub for %s\n", getName(), bus_device.name, getMatchedName(child));
-        } else if (!device_nub->start(this)) {
-            device_nub->detach(this);
-            IOLog("%s::%s Could not start nub for %s\n", getName(), bus_device.name, getMatchedName(child));
         } else {
-            device_nubs->setObject(device_nub);
+            attached_nubs->setObject(device_nub);
+
+            /* The I2C specification has every device on the bus keep up with the clock, so it runs at the pace of the slowest one */
+            if (OSNumber* scl_speed = OSDynamicCast(OSNumber, device_nub->getProperty("sclHz"))) {
+                UInt32 speed = scl_speed->unsigned32BitValue();
+
+                if (speed && (!bus_device.speed_limit || speed < bus_device.speed_limit))
+                    bus_device.speed_limit = speed;
+            }
         }
 
         OSSafeReleaseNULL(child_properties);
@@ -387,103 +1327,201 @@ IOReturn VoodooI2CControllerDriver::publishNubs() {
     }
     children->release();
 
+    if (bus_device.speed_limit)
+        IOLog("%s::%s Bus speed below high speed mode is limited to %u Hz\n", getName(), bus_device.name, bus_device.speed_limit);
+
+    for (unsigned int i = 0; i < attached_nubs->getCount(); i++) {
+        VoodooI2CDeviceNub* device_nub = OSDynamicCast(VoodooI2CDeviceNub, attached_nubs->getObject(i));
+        IOService* acpi_device = OSDynamicCast(IOService, device_nub->getProperty("acpi-device"));
+
+        if (!device_nub->start(this)) {
+            device_nub->detach(this);
+            IOLog("%s::%s Could not start nub for %s\n", getName(), bus_device.name, acpi_device ? getMatchedName(acpi_device) : "unknown device");
+        } else {
+            device_nubs->setObject(device_nub);
+        }
+    }
+    attached_nubs->release();
+
     return kIOReturnSuccess;
 }
 
-UInt32 VoodooI2CControllerDriver::readClearInterruptBits() {
-    UInt32 stat;
-    stat = readRegister(DW_IC_INTR_STAT);
-
-    if (stat & DW_IC_INTR_RX_UNDER)
-        readRegister(DW_IC_CLR_RX_UNDER);
-    if (stat & DW_IC_INTR_RX_OVER)
-        readRegister(DW_IC_CLR_RX_OVER);
-    if (stat & DW_IC_INTR_TX_OVER)
-        readRegister(DW_IC_CLR_TX_OVER);
-    if (stat & DW_IC_INTR_RD_REQ)
-        readRegister(DW_IC_CLR_RD_REQ);
-    if (stat & DW_IC_INTR_TX_ABRT) {
-        bus_device.abort_source = readRegister(DW_IC_TX_ABRT_SOURCE);
-        readRegister(DW_IC_CLR_TX_ABRT);
+void VoodooI2CControllerDriver::clearInterruptBits(UInt32 status) {
+    /* Reading DW_IC_CLR_INTR or DW_IC_CLR_TX_ABRT also clears the abort source, so capture it first */
+    if (status & DW_IC_INTR_TX_ABRT)
+        bus_device.state->abort_source = readRegister(DW_IC_TX_ABRT_SOURCE);
+
+    /*
+     * Reading DW_IC_CLR_INTR clears every latched interrupt at once, including
+     * any raised after the status was read. That is only safe once STOP_DET is
+     * being acknowledged since nothing the transfer waits for can follow it.
+     * While reads are still outstanding STOP_DET is left pending so that it
+     * fires again once the RX FIFO has been drained.
+     */
+    if ((status & DW_IC_INTR_STOP_DET) && ((bus_device.state->receive_outstanding == 0) || (status & DW_IC_INTR_RX_FULL))) {
+        readRegister(DW_IC_CLR_INTR);
+        return;
     }
-    if (stat & DW_IC_INTR_RX_DONE)
-        readRegister(DW_IC_CLR_RX_DONE);
-    if (stat & DW_IC_INTR_ACTIVITY)
-        readRegister(DW_IC_CLR_ACTIVITY);
-    if ((stat & DW_IC_INTR_STOP_DET) && ((bus_device.receive_outstanding == 0) || (stat & DW_IC_INTR_RX_FULL)))
-        readRegister(DW_IC_CLR_STOP_DET);
-    if (stat & DW_IC_INTR_START_DET)
-        readRegister(DW_IC_CLR_START_DET);
-    if (stat & DW_IC_INTR_GEN_CALL)
-        readRegister(DW_IC_CLR_GEN_CALL);
 
-    return stat;
+    /* RX_FULL and TX_EMPTY follow the FIFO levels, TX_ABRT is the only other interrupt the driver unmasks */
+    if (status & DW_IC_INTR_TX_ABRT)
+        readRegister(DW_IC_CLR_TX_ABRT);
 }
 
 void VoodooI2CControllerDriver::readFromBus() {
-    VoodooI2CControllerBusMessage *messages = bus_device.messages;
+    VoodooI2CControllerBusMessage *messages = bus_device.state->messages;
     int receive_valid;
 
-    for (; bus_device.message_read_index < bus_device.message_number; bus_device.message_read_index++) {
+    for (; bus_device.state->message_read_index < bus_device.state->message_number; bus_device.state->message_read_index++) {
         UInt32 length;
         UInt8 *buffer;
 
         /** if current message is not a read, skip */
-        if (!(messages[bus_device.message_read_index].flags & I2C_M_RD))
+        if (!(messages[bus_device.state->message_read_index].flags & I2C_M_RD))
+            continue;
+
+        /** controllers without quick command support read a byte instead, throw it away */
+        if (messages[bus_device.state->message_read_index].length == 0) {
+            for (receive_valid = readRegister(DW_IC_RXFLR); receive_valid > 0 && bus_device.state->receive_outstanding > 0; receive_valid--) {
+                readRegister(DW_IC_DATA_CMD);
+                bus_device.state->receive_outstanding--;
+            }
             continue;
+        }
 
         /** if a read is not in progress then take the length and the current message in the loop
             else just set the length and buffer to the previous length and buffer */
-        if (!(bus_device.status & STATUS_READ_IN_PROGRESS)) {
-            length = messages[bus_device.message_read_index].length;
-            buffer = messages[bus_device.message_read_index].buffer;
+        if (!(bus_device.state->status & STATUS_READ_IN_PROGRESS)) {
+            length = messages[bus_device.state->message_read_index].length;
+            buffer = messages[bus_device.state->message_read_index].buffer;
         } else {
-            length = bus_device.receive_buffer_length;
-            buffer = bus_device.receive_buffer;
+            length = bus_device.state->receive_buffer_length;
+            buffer = bus_device.state->receive_buffer;
         }
 
         /** check how many items left in receive buffer */
         receive_valid = readRegister(DW_IC_RXFLR);
 
         /** collect data from receive buffer */
-        for (; length > 0 && receive_valid > 0; length--, receive_valid--) {
+        while (length > 0 && receive_valid > 0) {
             *buffer++ = readRegister(DW_IC_DATA_CMD);
-            bus_device.receive_outstanding--;
+            bus_device.state->receive_outstanding--;
+            length--; receive_valid--;
+
+            if (messages[bus_device.state->message_read_index].flags & (I2C_M_RECV_LEN | I2C_M_RECV_LEN16))
+                length = receiveLengthHeader(&messages[bus_device.state->message_read_index], (UInt32)(buffer - messages[bus_device.state->message_read_index].buffer), length);
         }
 
         /** if there are still more messages to read, set status to read in progress and continue
             else remove read in progress status */
         if (length > 0) {
-            bus_device.status |= STATUS_READ_IN_PROGRESS;
-            bus_device.receive_buffer_length = length;
-            bus_device.receive_buffer = buffer;
-            return;
+            bus_device.state->status |= STATUS_READ_IN_PROGRESS;
+            bus_device.state->receive_buffer_length = length;
+            bus_device.state->receive_buffer = buffer;
+            break;
         } else {
-            bus_device.status &= ~STATUS_READ_IN_PROGRESS;
+            bus_device.state->status &= ~STATUS_READ_IN_PROGRESS;
         }
     }
+
+    updateReceiveThreshold();
+}
+
+UInt32 VoodooI2CControllerDriver::receiveLengthHeader(VoodooI2CControllerBusMessage* message, UInt32 received, UInt32 length) {
+    UInt32 header = I2C_M_RECV_LEN_HEADER(message->flags);
+    UInt32 total;
+
+    if (received < header || bus_device.state->receive_length_index == bus_device.state->message_read_index)
+        return length;
+
+    total = getReceiveLength(message);
+    bus_device.state->receive_length_index = bus_device.state->message_read_index;
+
+    /* Hand the rest of the read commands to transferMessageToBus, which is waiting on the header */
+    bus_device.state->transaction_buffer_length = total - header;
+    setInterruptMask(bus_device.state->interrupt_mask | DW_IC_INTR_TX_EMPTY);
+
+    return total - received;
+}
+
+UInt32 VoodooI2CControllerDriver::getReceiveLength(VoodooI2CControllerBusMessage* message) {
+    UInt32 header = I2C_M_RECV_LEN_HEADER(message->flags);
+    UInt32 total;
+
+    if (message->flags & I2C_M_RECV_LEN16) {
+        /* HID over I2C reports start with their total length, header included */
+        total = message->buffer[0] | (message->buffer[1] << 8);
+    } else {
+        /* SMBus block reads start with the number of data bytes that follow, the PEC comes on top */
+        total = message->buffer[0] + ((message->flags & I2C_CLIENT_PEC) ? 2 : 1);
+    }
+
+    /* STOP goes out along with a read command, so there has to be at least one byte past the header */
+    if (total <= header)
+        total = header + 1;
+    if (total > message->length)
+        total = message->length;
+
+    return total;
+}
+
+void VoodooI2CControllerDriver::releaseDMA() {
+    if (dma_command) {
+        dma_command->clearMemoryDescriptor();
+        OSSafeReleaseNULL(dma_command);
+    }
+
+    if (dma_buffer) {
+        dma_buffer->complete();
+        OSSafeReleaseNULL(dma_buffer);
+    }
+
+    dma_buffer_address = 0;
 }
 
 void VoodooI2CControllerDriver::releaseResources() {
     stopI2CInterrupt();
 
+    if (timeout_source) {
+        timeout_source->cancelTimeout();
+        work_loop->removeEventSource(timeout_source);
+    }
+
     if (command_gate) {
         work_loop->removeEventSource(command_gate);
     }
 
+    releaseDMA();
+
+    OSSafeReleaseNULL(timeout_source);
     OSSafeReleaseNULL(command_gate);
     OSSafeReleaseNULL(work_loop);
-
-    if (i2c_bus_lock) {
-        IOLockFree(i2c_bus_lock);
-    }
 }
 
 void VoodooI2CControllerDriver::requestTransferI2C() {
-    VoodooI2CControllerBusMessage *messages = bus_device.messages;
-    UInt32 i2c_configuration, i2c_target = 0, orig;
+    VoodooI2CControllerBusMessage *messages = bus_device.state->messages;
+    UInt32 i2c_configuration, i2c_target = 0;
+
+    if (canKeepAdapterEnabled() && bus_device.state->adapter_enabled) {
+        /*
+         * IC_CON may not be written while the adapter is enabled, but with
+         * I2C_DYNAMIC_TAR_UPDATE the 10-bit addressing mode is taken from
+         * bit 12 of IC_TAR so reprogramming IC_TAR is all that is needed.
+         */
+        if (messages[bus_device.state->message_write_index].flags & I2C_M_TEN)
+            i2c_target = DW_IC_TAR_10BITADDR_MASTER;
+        if (bus_device.state->quick_command)
+            i2c_target |= DW_IC_TAR_SPECIAL | DW_IC_TAR_SMBUS_QUICK_CMD;
 
-    if (nub->controller->physical_device.access_intr_mask_workaround) {
+        writeShadowedRegister(messages[bus_device.state->message_write_index].address | i2c_target, DW_IC_TAR);
+
+        setTransferThresholds();
+
+        startTransferInterrupts();
+        return;
+    }
+
+    if (bus_device.quirks & DW_IC_QUIRK_ACCESS_INTR_MASK) {
         // Linux code works with black magic, on macOS with AMD I2C turning off the adapter
         // and rewriting the bus settings is required
         initialiseBus();
@@ -492,8 +1530,8 @@ void VoodooI2CControllerDriver::requestTransferI2C() {
     }
 
     /* if the slave address is ten bit address, enable 10BITADDR */
-    orig = i2c_configuration = readRegister(DW_IC_CON);
-    if (messages[bus_device.message_write_index].flags & I2C_M_TEN) {
+    i2c_configuration = readShadowedRegister(DW_IC_CON);
+    if (messages[bus_device.state->message_write_index].flags & I2C_M_TEN) {
         i2c_configuration |= DW_IC_CON_10BITADDR_MASTER;
         /*
          * If I2C_DYNAMIC_TAR_UPDATE is set, the 10-bit addressing
@@ -506,60 +1544,93 @@ void VoodooI2CControllerDriver::requestTransferI2C() {
         i2c_configuration &= ~DW_IC_CON_10BITADDR_MASTER;
     }
 
-    if (i2c_configuration != orig)
-        writeRegister(i2c_configuration, DW_IC_CON);
+    writeShadowedRegister(i2c_configuration, DW_IC_CON);
+
+    if (bus_device.state->quick_command)
+        i2c_target |= DW_IC_TAR_SPECIAL | DW_IC_TAR_SMBUS_QUICK_CMD;
 
     /*
      * Set the slave (target) address and enable 10-bit addressing mode
      * if applicable.
      */
-    writeRegister(messages[bus_device.message_write_index].address | i2c_target, DW_IC_TAR);
+    writeShadowedRegister(messages[bus_device.state->message_write_index].address | i2c_target, DW_IC_TAR);
 
     toggleInterrupts(kVoodooI2CStateOff);
 
+    setTransferThresholds();
+
     toggleBusState(kVoodooI2CStateOn);
 
     /* Dummy read to avoid the register getting stuck on Bay Trail */
-    readRegister(DW_IC_ENABLE_STATUS);
+    if (bus_device.quirks & DW_IC_QUIRK_BAYTRAIL_DUMMY_READ)
+        readRegister(DW_IC_ENABLE_STATUS);
 
-    toggleInterrupts(kVoodooI2CStateOn);
+    startTransferInterrupts();
 }
 
 IOReturn VoodooI2CControllerDriver::setPowerState(unsigned long whichState, IOService *whatDevice) {
     if (whatDevice != this)
         return kIOPMAckImplied;
 
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CControllerDriver::setPowerStateGated), &whichState);
+}
+
+IOReturn VoodooI2CControllerDriver::setPowerStateGated(unsigned long* whichState) {
+    if (*whichState == 0)
+        sleep_pending = true;
+
     // Ensure we are not in the middle of a i2c session.
-    IOLockLock(i2c_bus_lock);
-    if (whichState == 0) {  // index of kIOPMPowerOff state in VoodooI2CIOPMPowerStates
-        if (bus_device.awake) {
-            bus_device.awake = false;
+    while (active_transfer || transfer_queue_head)
+        command_gate->commandSleep(&active_transfer);
+
+    if (*whichState == 0) {  // index of kIOPMPowerOff state in VoodooI2CIOPMPowerStates
+        if (bus_device.state->awake) {
+            bus_device.state->awake = false;
             toggleBusState(kVoodooI2CStateOff);
             stopI2CInterrupt();
+            /* The controller unmaps its registers once we are powered off */
+            bus_device.state->register_base = nullptr;
+            invalidateShadowRegisters();
             IOLog("%s::%s Going to sleep\n", getName(), bus_device.name);
         }
     } else {
-        if (!bus_device.awake) {
+        if (!bus_device.state->awake) {
+            cacheRegisterBase();
+            invalidateShadowRegisters();
             toggleBusState(kVoodooI2CStateOn);
             initialiseBus();
             toggleInterrupts(kVoodooI2CStateOff);
-            bus_device.awake = true;
+            bus_device.state->awake = true;
             startI2CInterrupt();
             IOLog("%s::%s Woke up\n", getName(), bus_device.name);
         }
+
+        sleep_pending = false;
     }
-    IOLockUnlock(i2c_bus_lock);
     return kIOPMAckImplied;
 }
 
+void VoodooI2CControllerDriver::setTransferThresholds() {
+    UInt32 commands = bus_device.state->transaction_commands, depth = bus_device.transaction_fifo_depth;
+    UInt32 transaction_threshold = depth / 2;
+
+    /*
+     * If what is left after the first FIFO fill is less than half a FIFO,
+     * ask for TX_EMPTY as soon as there is room for all of it so that the
+     * remainder goes out in a single refill.
+     */
+    if (commands > depth && commands - depth < transaction_threshold)
+        transaction_threshold = depth - (commands - depth);
+
+    writeShadowedRegister(transaction_threshold, DW_IC_TX_TL);
+    writeShadowedRegister(0, DW_IC_RX_TL);
+}
+
 bool VoodooI2CControllerDriver::start(IOService* provider) {
     if (!super::start(provider))
         return false;
-    i2c_bus_lock = IOLockAlloc();
-    if (!i2c_bus_lock) {
-        IOLog("%s::%s Could not allocate I2C bus lock\n", getName(), bus_device.name);
-        goto exit;
-    }
+
+    cacheRegisterBase();
 
     work_loop = getWorkLoop();
     if (!work_loop) {
@@ -575,6 +1646,12 @@ bool VoodooI2CControllerDriver::start(IOService* provider) {
         goto exit;
     }
 
+    timeout_source = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooI2CControllerDriver::handleTransferTimeout));
+    if (!timeout_source || (work_loop->addEventSource(timeout_source) != kIOReturnSuccess)) {
+        IOLog("%s::%s Could not add transfer timeout source\n", getName(), bus_device.name);
+        goto exit;
+    }
+
     PMinit();
     nub->joinPMtree(this);
     registerPowerDriver(this, VoodooI2CIOPMPowerStates, kVoodooI2CIOPMNumberPowerStates);
@@ -587,8 +1664,37 @@ bool VoodooI2CControllerDriver::start(IOService* provider) {
 
     setBusConfigProperties();
 
-    bus_device.functionality = I2C_FUNC_I2C | I2C_FUNC_10BIT_ADDR | I2C_FUNC_SMBUS_BYTE | I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_WORD_DATA | I2C_FUNC_SMBUS_I2C_BLOCK;
-    bus_device.bus_config = DW_IC_CON_MASTER | DW_IC_CON_SLAVE_DISABLE | DW_IC_CON_RESTART_EN | DW_IC_CON_SPEED_FAST;
+    if (OSNumber* budget = OSDynamicCast(OSNumber, getProperty("PolledTransferBudget")))
+        polled_transfer_budget = budget->unsigned32BitValue();
+
+    if (OSNumber* allowance = OSDynamicCast(OSNumber, getProperty("ClockStretchAllowance")))
+        clock_stretch_allowance = allowance->unsigned32BitValue();
+
+    if (OSBoolean* calibrate = OSDynamicCast(OSBoolean, getProperty("CalibrateSCL")))
+        calibration.enabled = calibrate->getValue();
+
+    if (OSNumber* threshold = OSDynamicCast(OSNumber, getProperty("DMAThreshold")))
+        dma_threshold = threshold->unsigned32BitValue();
+
+    /* Large runs can bypass the FIFO handlers on Intel LPSS controllers, which have their own iDMA */
+    if (dma_threshold && nub->controller->physical_device.has_idma && initialiseDMA() != kIOReturnSuccess)
+        IOLog("%s::%s Could not allocate DMA buffer, transfers will not use DMA\n", getName(), bus_device.name);
+
+    bus_device.functionality = I2C_FUNC_I2C | I2C_FUNC_10BIT_ADDR | I2C_FUNC_SMBUS_BYTE | I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_WORD_DATA | I2C_FUNC_SMBUS_I2C_BLOCK | I2C_FUNC_SMBUS_BLOCK_DATA | I2C_FUNC_SMBUS_PROC_CALL | I2C_FUNC_SMBUS_PEC;
+    /* Fast mode unless the controller is told otherwise, faster modes need the hardware and the timings to support them */
+    bus_device.bus_speed = I2C_MAX_FAST_MODE_FREQ;
+    if (OSNumber* speed = OSDynamicCast(OSNumber, getProperty("BusSpeed"))) {
+        bus_device.bus_speed = speed->unsigned32BitValue();
+        /* An explicit bus speed also caps the devices asking for more */
+        bus_device.speed_limit = bus_device.bus_speed;
+    }
+
+    if (getSupportedBusSpeed(bus_device.bus_speed) < bus_device.bus_speed)
+        IOLog("%s::%s Bus speed of %u Hz is not supported, using %u Hz\n", getName(), bus_device.name, bus_device.bus_speed, getSupportedBusSpeed(bus_device.bus_speed));
+    bus_device.bus_speed = getSupportedBusSpeed(bus_device.bus_speed);
+    bus_device.current_speed = bus_device.bus_speed;
+
+    bus_device.bus_config = DW_IC_CON_MASTER | DW_IC_CON_SLAVE_DISABLE | DW_IC_CON_RESTART_EN | getSpeedConfig(bus_device.bus_speed);
 
     /*
      * On AMD platforms BIOS advertises the bus clear feature
@@ -601,6 +1707,11 @@ bool VoodooI2CControllerDriver::start(IOService* provider) {
         bus_device.bus_config |= DW_IC_CON_BUS_CLEAR_CTRL;
     }
 
+    if (OSBoolean* quick_command = OSDynamicCast(OSBoolean, getProperty("SMBusQuickCommand"))) {
+        if (quick_command->getValue())
+            bus_device.functionality |= I2C_FUNC_SMBUS_QUICK;
+    }
+
     if (initialiseBus() != kIOReturnSuccess) {
         IOLog("%s::%s Could not initialise bus\n", getName(), bus_device.name);
         return false;
@@ -616,6 +1727,11 @@ bool VoodooI2CControllerDriver::start(IOService* provider) {
 
     registerService();
 
+    if (OSBoolean* scan_bus = OSDynamicCast(OSBoolean, getProperty("ScanBus"))) {
+        if (scan_bus->getValue())
+            scanBus();
+    }
+
     publishNubs();
 
     return true;
@@ -636,7 +1752,7 @@ void VoodooI2CControllerDriver::stop(IOService* provider) {
 
     OSSafeReleaseNULL(device_nubs);
 
-    if (bus_device.awake) {
+    if (bus_device.state->awake) {
         toggleBusState(kVoodooI2CStateOff);
     }
 
@@ -655,6 +1771,7 @@ IOReturn VoodooI2CControllerDriver::toggleBusState(VoodooI2CState enabled) {
 
         if ((readRegister(DW_IC_ENABLE_STATUS) & 1) == enabled) {
             toggleClockGating(enabled);
+            bus_device.state->adapter_enabled = enabled;
             return kIOReturnSuccess;
         }
 
@@ -665,78 +1782,210 @@ IOReturn VoodooI2CControllerDriver::toggleBusState(VoodooI2CState enabled) {
     return kIOReturnTimeout;
 }
 
+bool VoodooI2CControllerDriver::canTransferDMA(VoodooI2CControllerBusMessage* messages, int number) {
+    if (!dma_buffer || bus_device.state->quick_command || bus_device.state->probe_read)
+        return false;
+
+    if (bus_device.state->transaction_commands < dma_threshold || bus_device.state->transaction_commands > IDMA_MAX_COMMANDS)
+        return false;
+
+    if (number > 2 || (number == 2 && ((messages[0].flags & I2C_M_RD) || !(messages[1].flags & I2C_M_RD))))
+        return false;
+
+    for (int i = 0; i < number; i++) {
+        if (messages[i].flags & (I2C_M_RECV_LEN | I2C_M_RECV_LEN16))
+            return false;
+    }
+
+    return true;
+}
+
+inline UInt32 VoodooI2CControllerDriver::readRegister(int offset) {
+#ifdef DEBUG
+    bus_device.statistics.register_accesses++;
+#endif
+
+    if (bus_device.state->register_base)
+        return *(volatile UInt32 *)(bus_device.state->register_base + offset);
+
+    return nub->readRegister(offset);
+}
+
+inline UInt32 VoodooI2CControllerDriver::readShadowedRegister(int offset) {
+    UInt32 index = offset >> 2;
+
+    if (!(shadow_valid & BIT(index))) {
+        shadow_registers[index] = readRegister(offset);
+        shadow_valid |= BIT(index);
+    }
+
+    return shadow_registers[index];
+}
+
+inline void VoodooI2CControllerDriver::writeShadowedRegister(UInt32 value, int offset) {
+    UInt32 index = offset >> 2;
+
+    if ((shadow_valid & BIT(index)) && shadow_registers[index] == value)
+        return;
+
+    writeRegister(value, offset);
+    shadow_registers[index] = value;
+    shadow_valid |= BIT(index);
+}
+
+inline void VoodooI2CControllerDriver::writeRegister(UInt32 value, int offset) {
+#ifdef DEBUG
+    bus_device.statistics.register_accesses++;
+#endif
+
+    if (bus_device.state->register_base)
+        *(volatile UInt32 *)(bus_device.state->register_base + offset) = value;
+    else
+        nub->writeRegister(value, offset);
+}
+
+void VoodooI2CControllerDriver::cacheRegisterBase() {
+    IOMemoryMap* mmap = nub->controller->physical_device.mmap;
+
+    bus_device.state->register_base = mmap ? (volatile UInt8*)mmap->getVirtualAddress() : nullptr;
+}
+
+inline bool VoodooI2CControllerDriver::canKeepAdapterEnabled() {
+    return nub->controller->physical_device.dynamic_tar_update && !(bus_device.quirks & DW_IC_QUIRK_ACCESS_INTR_MASK);
+}
+
 inline void VoodooI2CControllerDriver::toggleClockGating(VoodooI2CState enabled) {
-    const char *name = nub->controller->physical_device.name;
-    if (name[0] == 'A' && name[1] == 'M' && name[2] == 'D') {
+    if (bus_device.quirks & DW_IC_QUIRK_AMD_CLOCK_GATING) {
         writeRegister(enabled, LPSS_PRIVATE_CLOCK_GATING);
     }
 }
 
 void VoodooI2CControllerDriver::toggleInterrupts(VoodooI2CState enabled) {
     if (!enabled) {
-        writeRegister(0, DW_IC_INTR_MASK);
+        /*
+         * setInterruptMask leaves the hardware alone while polling, but a
+         * mask left over from a timed out transfer must not survive into
+         * a polled one, whose interrupts the filter would not claim.
+         */
+        bus_device.state->interrupt_mask = 0;
+        shadow_valid &= ~BIT(DW_IC_INTR_MASK >> 2);
+        writeShadowedRegister(0, DW_IC_INTR_MASK);
     } else {
         readRegister(DW_IC_CLR_INTR);
-        writeRegister(DW_IC_INTR_DEFAULT_MASK, DW_IC_INTR_MASK);
+        setInterruptMask(DW_IC_INTR_DEFAULT_MASK);
     }
 }
 
 IOReturn VoodooI2CControllerDriver::transferI2C(VoodooI2CControllerBusMessage* messages, int number) {
-    IOLockLock(i2c_bus_lock);
-    IOReturn ret = command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CControllerDriver::transferI2CGated), messages, &number);
-    IOLockUnlock(i2c_bus_lock);
-    return ret;
+    return transferI2C(messages, number, 0);
 }
 
-IOReturn VoodooI2CControllerDriver::transferI2CGated(VoodooI2CControllerBusMessage* messages, int* number) {
-    IOReturn ret;
-    int tries;
+IOReturn VoodooI2CControllerDriver::transferI2C(VoodooI2CControllerBusMessage* messages, int number, UInt32 speed) {
+    VoodooI2CControllerTransfer transfer {};
 
-    for (ret = 0, tries = 0; tries <= 5; tries++) {
-        ret = prepareTransferI2C(messages, number);
-        if (ret != kIOReturnNotReady)
-            break;
-    }
+    transfer.messages = messages;
+    transfer.number = number;
+    transfer.speed = speed;
+
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CControllerDriver::transferI2CGated), &transfer);
+}
+
+IOReturn VoodooI2CControllerDriver::transferI2CAsync(VoodooI2CControllerBusMessage* messages, int number, VoodooI2CControllerTransferCompletion completion, void* context, UInt32 speed) {
+    if (!completion)
+        return kIOReturnBadArgument;
+
+    VoodooI2CControllerTransfer* transfer = reinterpret_cast<VoodooI2CControllerTransfer*>(IOMalloc(sizeof(VoodooI2CControllerTransfer)));
+    if (!transfer)
+        return kIOReturnNoMemory;
+
+    memset(transfer, 0, sizeof(VoodooI2CControllerTransfer));
+    transfer->allocated = true;
+    transfer->completion = completion;
+    transfer->context = context;
+    transfer->messages = messages;
+    transfer->number = number;
+    transfer->speed = speed;
+
+    IOReturn ret = command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CControllerDriver::submitTransferGated), transfer);
+    if (ret != kIOReturnSuccess)
+        IOFree(transfer, sizeof(VoodooI2CControllerTransfer));
 
     return ret;
 }
 
+IOReturn VoodooI2CControllerDriver::transferI2CGated(VoodooI2CControllerTransfer* transfer) {
+    IOReturn ret = submitTransferGated(transfer);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    while (!transfer->done)
+        command_gate->commandSleep(transfer);
+
+    return transfer->result;
+}
+
 void VoodooI2CControllerDriver::transferMessageToBus() {
-    VoodooI2CControllerBusMessage *messages = bus_device.messages;
+    VoodooI2CControllerBusMessage *messages = bus_device.state->messages;
     UInt32 interrupt_mask;
     int transaction_limit, receive_limit;
-    UInt32 address = messages[bus_device.message_write_index].address;
-    UInt32 buffer_length = bus_device.transaction_buffer_length;
-    UInt8 *buffer = bus_device.transaction_buffer;
-    bool need_restart = false;
+    UInt32 buffer_length = bus_device.state->transaction_buffer_length;
+    UInt8 *buffer = bus_device.state->transaction_buffer;
+    bool need_restart = false, receive_throttled = false, length_pending = false;
 
     interrupt_mask = DW_IC_INTR_DEFAULT_MASK;
 
-    for (; bus_device.message_write_index < bus_device.message_number; bus_device.message_write_index++) {
+    /* startTransferI2C only hands over runs for a single address, so DW_IC_TAR stays valid for every message */
+    for (; bus_device.state->message_write_index < bus_device.state->message_number; bus_device.state->message_write_index++) {
         /*
-         * if target address has changed, we need to
-         * reprogram the target address in the i2c
-         * adapter when we are done with this transfer
+         * A quick command is just the address byte and the STOP, it goes
+         * out with a single command whose data the controller ignores.
          */
-        if (messages[bus_device.message_write_index].address != address) {
-            bus_device.message_error = -1;
+        if (bus_device.state->quick_command) {
+            writeRegister(0x200 | ((messages[bus_device.state->message_write_index].flags & I2C_M_RD) ? 0x100 : 0), DW_IC_DATA_CMD);
+            continue;
+        }
+
+        /* Without quick command support a zero-length read reads a single byte, which readFromBus throws away */
+        if (bus_device.state->probe_read) {
+            writeRegister(0x200 | 0x100, DW_IC_DATA_CMD);
+            bus_device.state->receive_outstanding++;
+            continue;
+        }
+
+        /* ... but there is no way to send a lone zero-length write */
+        if (bus_device.state->message_number == 1 && messages[bus_device.state->message_write_index].length == 0) {
+            bus_device.state->message_error = -1;
+            break;
+        }
+
+        /* A length-prefixed read needs room for at least one byte past its header */
+        if (messages[bus_device.state->message_write_index].length <= I2C_M_RECV_LEN_HEADER(messages[bus_device.state->message_write_index].flags)) {
+            bus_device.state->message_error = -1;
             break;
         }
 
-        if (messages[bus_device.message_write_index].length == 0) {
-            bus_device.message_error = -1;
+        /* Only a write can be continued, and only by another write */
+        if ((messages[bus_device.state->message_write_index].flags & I2C_M_NOSTART) &&
+            (bus_device.state->message_write_index == 0 || (messages[bus_device.state->message_write_index].flags & I2C_M_RD) ||
+             (messages[bus_device.state->message_write_index - 1].flags & I2C_M_RD))) {
+            bus_device.state->message_error = -1;
             break;
         }
 
-        if (!(bus_device.status & STATUS_WRITE_IN_PROGRESS)) {
-            buffer = messages[bus_device.message_write_index].buffer;
-            buffer_length = messages[bus_device.message_write_index].length;
+        if (!(bus_device.state->status & STATUS_WRITE_IN_PROGRESS)) {
+            buffer = messages[bus_device.state->message_write_index].buffer;
+            buffer_length = messages[bus_device.state->message_write_index].length;
+
+            /* Only read the header for now, the rest of the message is issued once its length is known */
+            if (I2C_M_RECV_LEN_HEADER(messages[bus_device.state->message_write_index].flags))
+                buffer_length = I2C_M_RECV_LEN_HEADER(messages[bus_device.state->message_write_index].flags);
 
             /* If both IC_EMPTYFIFO_HOLD_MASTER_EN and
              * IC_RESTART_EN are set, we must manually
              * set restart bit between messages.
              */
-            if ((bus_device.bus_config & DW_IC_CON_RESTART_EN) && (bus_device.message_write_index > 0)) {
+            if ((bus_device.bus_config & DW_IC_CON_RESTART_EN) && (bus_device.state->message_write_index > 0) &&
+                !(messages[bus_device.state->message_write_index].flags & I2C_M_NOSTART)) {
                 need_restart = true;
             }
         }
@@ -754,7 +2003,9 @@ void VoodooI2CControllerDriver::transferMessageToBus() {
              * when writing/reading the last byte.
              */
 
-            if (bus_device.message_write_index == bus_device.message_number - 1 && buffer_length == 1) {
+            if (bus_device.state->message_write_index == bus_device.state->message_number - 1 && buffer_length == 1 &&
+                (!I2C_M_RECV_LEN_HEADER(messages[bus_device.state->message_write_index].flags) ||
+                 bus_device.state->receive_length_index == bus_device.state->message_write_index)) {
                 command |= 0x200;
             }
 
@@ -762,82 +2013,138 @@ void VoodooI2CControllerDriver::transferMessageToBus() {
                 command |= 0x400;
                 need_restart = false;
             }
-            if (messages[bus_device.message_write_index].flags & I2C_M_RD) {
+            if (messages[bus_device.state->message_write_index].flags & I2C_M_RD) {
                 /* avoid rx buffer overrun */
-                if (receive_limit - bus_device.receive_outstanding <= 0) {
+                if (receive_limit - bus_device.state->receive_outstanding <= 0) {
+                    receive_throttled = true;
                     break;
                 }
                 writeRegister(command | 0x100, DW_IC_DATA_CMD);
                 receive_limit--;
-                bus_device.receive_outstanding++;
+                bus_device.state->receive_outstanding++;
             } else {
                 writeRegister(command | *buffer++, DW_IC_DATA_CMD);
             }
             transaction_limit--; buffer_length--;
         }
 
-        bus_device.transaction_buffer = buffer;
-        bus_device.transaction_buffer_length = buffer_length;
+        bus_device.state->transaction_buffer = buffer;
+        bus_device.state->transaction_buffer_length = buffer_length;
 
-        if (buffer_length > 0) {
-            bus_device.status |= STATUS_WRITE_IN_PROGRESS;
+        /*
+         * We cannot stop the transaction while the length of a
+         * length-prefixed read is unknown. TX_EMPTY is masked until
+         * readFromBus has received the header to avoid an interrupt
+         * flood.
+         */
+        if (buffer_length == 0 && I2C_M_RECV_LEN_HEADER(messages[bus_device.state->message_write_index].flags) &&
+            bus_device.state->receive_length_index != bus_device.state->message_write_index) {
+            bus_device.state->status |= STATUS_WRITE_IN_PROGRESS;
+            length_pending = true;
+            break;
+        } else if (buffer_length > 0) {
+            bus_device.state->status |= STATUS_WRITE_IN_PROGRESS;
             break;
         } else {
-            bus_device.status &= ~STATUS_WRITE_IN_PROGRESS;
+            bus_device.state->status &= ~STATUS_WRITE_IN_PROGRESS;
         }
     }
 
     /*
      * If i2c_msg index search is completed, we don't need TX_EMPTY
-     * interrupt any more.
+     * interrupt any more. The same goes for while we are waiting for
+     * the RX FIFO to drain, the refill then happens on RX_FULL.
      */
-    if (bus_device.message_write_index == bus_device.message_number) {
+    if (bus_device.state->message_write_index == bus_device.state->message_number || receive_throttled || length_pending) {
         interrupt_mask &= ~DW_IC_INTR_TX_EMPTY;
     }
 
-    if (bus_device.message_error) {
+    updateReceiveThreshold();
+
+    if (bus_device.state->message_error) {
         interrupt_mask = 0;
     }
 
-    writeRegister(interrupt_mask, DW_IC_INTR_MASK);
+    setInterruptMask(interrupt_mask);
+}
+
+void VoodooI2CControllerDriver::updateReceiveThreshold() {
+    UInt32 receive_threshold;
+
+    if (bus_device.state->receive_outstanding <= 0)
+        return;
+
+    /*
+     * Waiting for every outstanding byte would let the TX FIFO run dry
+     * before the refill, stalling the bus or, without
+     * IC_EMPTYFIFO_HOLD_MASTER_EN, ending the read early on an automatic STOP.
+     */
+    receive_threshold = bus_device.state->receive_outstanding;
+    if (receive_threshold > bus_device.receive_fifo_depth / 2)
+        receive_threshold = bus_device.receive_fifo_depth / 2;
+    if (receive_threshold > 0)
+        receive_threshold--;
+
+    writeShadowedRegister(receive_threshold, DW_IC_RX_TL);
 }
 
 IOReturn VoodooI2CControllerDriver::waitBusNotBusyI2C() {
-    int timeout = TIMEOUT * 150, firstDelay = 100;
+    AbsoluteTime now;
 
-    while (readRegister(DW_IC_STATUS) & DW_IC_STATUS_ACTIVITY) {
-        if (timeout <= 0) {
-            IOLog("%s::%s Warning: Timeout waiting for bus not to be busy\n", getName(), bus_device.name);
-            return kIOReturnBusy;
-        }
-        timeout--;
-        if (firstDelay-- >= 0)
-            IODelay(100);
-        else
-            IOSleep(1);
+    if (bus_device.state->bus_idle) {
+        bus_device.statistics.idle_waits_skipped++;
+        goto idle;
+    }
+
+    if (!(readRegister(DW_IC_STATUS) & DW_IC_STATUS_ACTIVITY))
+        goto idle;
+
+    now = mach_absolute_time();
+
+    if (!idle_wait_deadline) {
+        clock_interval_to_absolutetime_interval(TIMEOUT * 150, kMillisecondScale, &idle_wait_deadline);
+        idle_wait_deadline += now;
+    } else if (now > idle_wait_deadline) {
+        IOLog("%s::%s Warning: Timeout waiting for bus not to be busy\n", getName(), bus_device.name);
+        idle_wait_deadline = 0;
+        return kIOReturnBusy;
     }
 
+    bus_device.statistics.idle_waits_deferred++;
+    return kIOReturnNotReady;
+
+idle:
+    idle_wait_deadline = 0;
     return kIOReturnSuccess;
 }
 
+UInt32 VoodooI2CControllerDriver::getBusIdleInterval() {
+    /* Give whoever holds the bus about a byte's worth of time, without rearming the timer more often than every 100us */
+    UInt32 interval = getSCLPeriod() * 9 / 1000;
+
+    return interval > 100 ? interval : 100;
+}
+
 IOReturn VoodooI2CControllerDriver::startI2CInterrupt() {
-    if (is_interrupt_registered) {
+    if (interrupt_source) {
         return kIOReturnStillOpen;
     }
-    IOReturn ret = nub->registerInterrupt(0, this, OSMemberFunctionCast(IOInterruptAction, this, &VoodooI2CControllerDriver::handleInterrupt), 0);
-    if (ret == kIOReturnSuccess) {
-        nub->enableInterrupt(0);
-        is_interrupt_registered = true;
-    } else {
+    interrupt_source = IOFilterInterruptEventSource::filterInterruptEventSource(this,
+        OSMemberFunctionCast(IOInterruptEventSource::Action, this, &VoodooI2CControllerDriver::handleInterrupt),
+        OSMemberFunctionCast(IOFilterInterruptEventSource::Filter, this, &VoodooI2CControllerDriver::filterInterrupt), nub, 0);
+    if (!interrupt_source || (work_loop->addEventSource(interrupt_source) != kIOReturnSuccess)) {
         IOLog("%s::%s::Could not register I2C interrupt\n", getName(), bus_device.name);
+        OSSafeReleaseNULL(interrupt_source);
+        return kIOReturnNoInterrupt;
     }
-    return ret;
+    interrupt_source->enable();
+    return kIOReturnSuccess;
 }
 
 void VoodooI2CControllerDriver::stopI2CInterrupt() {
-    if (is_interrupt_registered) {
-        nub->disableInterrupt(0);
-        nub->unregisterInterrupt(0);
-        is_interrupt_registered = false;
+    if (interrupt_source) {
+        interrupt_source->disable();
+        work_loop->removeEventSource(interrupt_source);
+        OSSafeReleaseNULL(interrupt_source);
     }
 }
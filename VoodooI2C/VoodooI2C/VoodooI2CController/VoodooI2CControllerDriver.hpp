@@ -10,8 +10,12 @@
 #define VoodooI2CControllerDriver_hpp
 
 #include <IOKit/IOLib.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IODMACommand.h>
 #include <IOKit/IOKitKeys.h>
+#include <IOKit/IOFilterInterruptEventSource.h>
 #include <IOKit/IOService.h>
+#include <IOKit/IOTimerEventSource.h>
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
 
 #include "VoodooI2CControllerConstants.hpp"
@@ -29,32 +33,132 @@ typedef struct {
 typedef struct {
     UInt32 ss_hcnt;
     UInt32 fs_hcnt;
+    UInt32 fp_hcnt;
+    UInt32 hs_hcnt;
     UInt32 ss_lcnt;
     UInt32 fs_lcnt;
+    UInt32 fp_lcnt;
+    UInt32 hs_lcnt;
     UInt32 sda_hold;
+    UInt32 scl_falling_time;
+    UInt32 sda_falling_time;
 } VoodooI2CControllerBusConfig;
 
+/* Called on the controller's work loop once a transfer submitted with
+ * <VoodooI2CControllerDriver::transferI2CAsync> has finished
+ * @context The context pointer passed along with the transfer
+ * @status  The result of the transfer, see <VoodooI2CControllerDriver::transferI2C>
+ */
+
+typedef void (*VoodooI2CControllerTransferCompletion)(void* context, IOReturn status);
+
+typedef struct VoodooI2CControllerTransfer {
+    bool allocated;
+    VoodooI2CControllerTransferCompletion completion;
+    void* context;
+    bool done;
+    VoodooI2CControllerBusMessage* messages;
+    struct VoodooI2CControllerTransfer* next;
+    int number;
+    IOReturn result;
+    int run_length;
+    int run_start;
+    UInt32 speed;
+    UInt64 submit_time;
+    int tries;
+} VoodooI2CControllerTransfer;
+
 typedef struct {
+    UInt64 bits;
+    UInt32 effective_rate;
+    bool enabled;
+    UInt64 nanoseconds;
+    AbsoluteTime run_started;
+    UInt32 samples;
+    UInt32 speed;
+} VoodooI2CControllerBusCalibration;
+
+typedef struct {
+    UInt32 dma_commands;
+    UInt32 idle_waits_deferred;
+    UInt32 idle_waits_skipped;
+    UInt32 interrupt_register_accesses;
+    UInt32 interrupts;
+    UInt32 latency_last_us;
+    UInt32 latency_max_us;
+    UInt32 polled_fallbacks;
+    UInt32 queue_depth;
+    UInt32 queue_depth_max;
+    UInt32 receive_interrupts;
+    UInt32 recovery_latency_last_us;
+    UInt32 register_accesses;
+    UInt32 transfers_chained;
+    UInt32 transfers_completed;
+    UInt32 transfers_dma;
+    UInt32 transfers_failed;
+    UInt32 transfers_interrupt;
+    UInt32 transfers_polled;
+    UInt32 transfers_prefilled;
+    UInt32 transfers_timed_out;
+} VoodooI2CControllerBusStatistics;
+
+#define VOODOOI2C_CACHE_LINE_SIZE 64
+
+/* State of the transfer on the bus
+ *
+ * These fields are touched for every FIFO refill and interrupt, so they are kept together on cache lines of their
+ * own instead of being spread between the configuration and the statistics of <VoodooI2CControllerBusDevice>. This
+ * includes everything that <VoodooI2CControllerDriver::filterInterrupt> reads or writes. The state is allocated on
+ * its own with <IOMallocAligned> as the allocator of the driver object does not honour the alignment.
+ */
+typedef struct alignas(VOODOOI2C_CACHE_LINE_SIZE) {
+    VoodooI2CControllerBusMessage* messages;
+    UInt8* receive_buffer;
+    volatile UInt8* register_base;
+    UInt8* transaction_buffer;
     UInt32 abort_source;
-    VoodooI2CControllerBusConfig acpi_config;
-    bool awake;
-    UInt32 bus_config;
     int command_error;
-    bool command_complete = false;
-    UInt32 functionality;
-    VoodooI2CControllerBusMessage* messages;
+    UInt32 interrupt_mask;
     int message_error;
     int message_number;
     int message_read_index;
     int message_write_index;
-    const char* name;
+    volatile UInt32 pending_status;
     UInt32 receive_buffer_length;
-    UInt8* receive_buffer;
-    UInt receive_fifo_depth;
+    int receive_length_index;
     int receive_outstanding;
     UInt status;
     UInt32 transaction_buffer_length;
-    UInt8* transaction_buffer;
+    UInt32 transaction_commands;
+    volatile AbsoluteTime transfer_stopped;
+    bool adapter_enabled;
+    bool awake;
+    bool bus_idle;
+    bool command_complete = false;
+    bool dma;
+    bool polling;
+    bool probe_read;
+    bool quick_command;
+    bool servicing;
+} VoodooI2CControllerTransferState;
+
+static_assert(alignof(VoodooI2CControllerTransferState) == VOODOOI2C_CACHE_LINE_SIZE, "transfer state must start a cache line");
+static_assert(sizeof(VoodooI2CControllerTransferState) <= 2 * VOODOOI2C_CACHE_LINE_SIZE, "transfer state should fit in two cache lines");
+
+typedef struct {
+    VoodooI2CControllerTransferState* state;
+    VoodooI2CControllerBusConfig acpi_config;
+    UInt32 bus_config;
+    UInt32 bus_speed;
+    UInt32 clock_rate;
+    UInt32 current_speed;
+    UInt32 functionality;
+    bool high_speed_capable;
+    const char* name;
+    UInt32 quirks;
+    UInt receive_fifo_depth;
+    UInt32 speed_limit;
+    VoodooI2CControllerBusStatistics statistics;
     UInt32 transaction_fifo_depth;
 } VoodooI2CControllerBusDevice;
 
@@ -81,9 +185,27 @@ class EXPORT VoodooI2CControllerDriver : public IOService {
 
     void free() override;
 
-    /* Handles an interrupt that has been asserted by the controller */
+    /* Checks whether the controller has asserted the interrupt
+     * @sender The interrupt event source
+     *
+     * This function runs in direct interrupt context. If one of the unmasked interrupts is pending, the controller's
+     * interrupt mask is cleared and <handleInterrupt> is scheduled on the work loop.
+     *
+     * @return *true* if the interrupt belongs to the controller, *false* otherwise
+     */
+
+    bool filterInterrupt(IOFilterInterruptEventSource* sender);
+
+    /* Services an interrupt that has been asserted by the controller
+     * @owner The owner of the event source
+     * @src   The interrupt event source
+     * @count The number of interrupts since the last call
+     *
+     * This function runs on the work loop and drives the transfer state machine with the status captured by
+     * <filterInterrupt>, then restores the interrupt mask or ends the transfer.
+     */
 
-    void handleInterrupt(OSObject* target, void* refCon, IOService* nubDevice, int source);
+    void handleInterrupt(OSObject* owner, IOInterruptEventSource* src, int count);
 
     /* Initialises <VoodooI2CControllerDriver> class
      * @properties OSDictionary* representing the matched personality
@@ -135,25 +257,207 @@ class EXPORT VoodooI2CControllerDriver : public IOService {
 
     void stop(IOService* provider) override;
 
-    /* Directs the command gate to add an I2C transfer routine to the work loop
+    /* Probes every 7-bit address for a slave device
+     *
+     * This function sends a zero-length read to each address from 0x08 to 0x77 in a single gated session and publishes
+     * the addresses that acknowledged as a 16-byte bitmap in the *ACKMap* property, with bit n standing for address n.
+     * The read goes out as an SMBus quick command if *SMBusQuickCommand* is set, otherwise as a plain one-byte read
+     * whose data is discarded. WARNING: This function must not be
+     * called from the controller's work loop.
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnNoMemory* if the property could not be allocated
+     */
+
+    IOReturn scanBus();
+
+    /* Queues an I2C transfer routine and waits for it to finish
      * @messages The messages to be transferred
      * @number   The number of messages
      *
-     * @return *kIOReturnSuccess* on success, *kIOReturnError* otherwise
+     * This function is a blocking wrapper around the controller's submission queue (see <transferI2CAsync>).
+     * The messages may be addressed to different slave devices, consecutive messages for the same address are
+     * sent as one run that ends with a STOP. A lone zero-length message for an address is sent as an SMBus quick
+     * command if the controller has been declared to support them (see *SMBusQuickCommand*). Otherwise a
+     * zero-length read is sent as a one-byte read whose data is discarded and a zero-length write fails.
+     * The *length* of an *I2C_M_RECV_LEN* or *I2C_M_RECV_LEN16* read is the size of its buffer on entry and is
+     * overwritten with the number of bytes received, header included, once the transfer has succeeded. Its flags
+     * are left untouched, so *length* has to be reset before the message is reused.
+     * WARNING: This function must not be called from the controller's work loop, in particular not from a
+     * <VoodooI2CControllerTransferCompletion> callback.
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnBusy* if the bus is busy or asleep, *kIOReturnTimeout* if the
+     * controller did not finish the transfer in time, *kIOReturnNoDevice* if a zero-length message was not acknowledged,
+     * *kIOReturnError* otherwise
      */
 
     IOReturn transferI2C(VoodooI2CControllerBusMessage* messages, int number);
 
+    /* Queues an I2C transfer routine at a given bus speed and waits for it to finish
+     * @messages The messages to be transferred
+     * @number   The number of messages
+     * @speed    The bus speed of the slave device in Hz, usually its ACPI *I2cSerialBus* connection speed, or 0
+     *           for the controller's *BusSpeed*
+     *
+     * The transfer runs at the fastest speed mode the controller supports that does not exceed *speed*. The
+     * controller only switches modes between transfers, see <transferI2C>.
+     *
+     * @return see <transferI2C>
+     */
+
+    IOReturn transferI2C(VoodooI2CControllerBusMessage* messages, int number, UInt32 speed);
+
+    /* Queues an I2C transfer routine without waiting for it to finish
+     * @messages   The messages to be transferred
+     * @number     The number of messages
+     * @completion The callback to be invoked once the transfer has finished
+     * @context    A pointer passed back to *completion*
+     * @speed      The bus speed of the slave device in Hz, or 0 for the controller's *BusSpeed*
+     *
+     * The transfer is appended to the controller's submission queue and started as soon as the bus is free.
+     * *completion* is invoked on the controller's work loop (possibly before this function returns) and must
+     * not block. The messages and their buffers must remain valid until *completion* has been invoked. As with
+     * <transferI2C>, the received length of a length-prefixed read is written back to its message.
+     *
+     * @return *kIOReturnSuccess* if the transfer was queued, *kIOReturnBadArgument* if *completion* is missing,
+     * *kIOReturnBusy* if the controller is going to sleep or is asleep, *kIOReturnNoMemory* otherwise. *completion*
+     * is only invoked if the transfer was queued.
+     */
+
+    IOReturn transferI2CAsync(VoodooI2CControllerBusMessage* messages, int number, VoodooI2CControllerTransferCompletion completion, void* context, UInt32 speed = 0);
+
  private:
+    VoodooI2CControllerTransfer* active_transfer = nullptr;
+    VoodooI2CControllerBusCalibration calibration {};
+    VoodooI2CControllerTransfer* chained_transfer = nullptr;
+    IOReturn chained_result = kIOReturnSuccess;
+    UInt32 clock_stretch_allowance = 25000;
     IOCommandGate* command_gate;
+    IOBufferMemoryDescriptor* dma_buffer = nullptr;
+    UInt64 dma_buffer_address = 0;
+    IODMACommand* dma_command = nullptr;
+    UInt32 dma_threshold = 0;
+    bool idle_wait_pending = false;
+    AbsoluteTime idle_wait_deadline = 0;
+    IOFilterInterruptEventSource* interrupt_source = nullptr;
+    UInt32 polled_transfer_budget = 100;
+    UInt32 shadow_registers[DW_IC_SHADOW_COUNT] {};
+    UInt32 shadow_valid = 0;
+    bool sleep_pending = false;
+    AbsoluteTime statistics_published = 0;
+    IOTimerEventSource* timeout_source = nullptr;
+    AbsoluteTime transfer_started = 0;
+    VoodooI2CControllerTransfer* transfer_queue_head = nullptr;
+    VoodooI2CControllerTransfer* transfer_queue_tail = nullptr;
     IOWorkLoop* work_loop = nullptr;
-    IOLock* i2c_bus_lock = nullptr;
-    bool is_interrupt_registered = false;
+
+    /* Caches the virtual address of the controller's registers in the <register_base> of the transfer state
+     *
+     * The mapping is owned by the controller and is recreated every time it is powered on, so this is called
+     * from <start> and whenever we wake up.
+     */
+
+    void cacheRegisterBase();
+
+    /* Checks whether the adapter may stay enabled between transfers
+     *
+     * This is the case for controllers configured with I2C_DYNAMIC_TAR_UPDATE, which cannot be detected from
+     * the registers and is therefore opted into via the *DynamicTARUpdate* property of the controller.
+     *
+     * @return *true* if only the target address needs to be reprogrammed between transfers, *false* otherwise
+     */
+
+    inline bool canKeepAdapterEnabled();
+
+    /* Evaluates a window of timed transfers
+     *
+     * This function publishes the effective bit rate measured over the window in the *BusConfig* property. With
+     * *CalibrateSCL* set and the input clock known, it also shortens the high and low counts of the current speed
+     * mode by a sixteenth if the bus runs at less than 90% of its nominal speed, but never below the I2C
+     * specification minimums plus a 10% margin and the fall times of the board. High-speed mode is left alone.
+     */
+
+    void calibrateBusTiming();
+
+    /* Checks whether the run about to be started can be carried out by the iDMA channels
+     * @messages The messages of the run
+     * @number   The number of messages
+     *
+     * Only runs of at least *DMAThreshold* commands that consist of a write, a read or a write followed by a
+     * read qualify, since the channels need to know every command up front.
+     *
+     * @return *true* if the run should go through DMA, *false* if it should be driven by the FIFO handlers
+     */
+
+    bool canTransferDMA(VoodooI2CControllerBusMessage* messages, int number);
+
+    /* Acknowledges the interrupts that have fired
+     * @status The pending *DW_IC_INTR_* bits
+     *
+     * A transfer ending on STOP_DET is acknowledged with a single read of *DW_IC_CLR_INTR*, otherwise only
+     * TX_ABRT needs clearing. The abort source is captured in *abort_source* before it is cleared.
+     */
+
+    void clearInterruptBits(UInt32 status);
+
+    /* Finishes the transfer that was chained behind the next queued transfer
+     *
+     * See <handleTransferComplete>. This is also called by <completeTransfer> so that transfers are always handed
+     * back in the order in which they ended.
+     */
+
+    void completeChainedTransfer();
+
+    /* Finishes the active transfer
+     * @transfer The transfer that has finished
+     * @result   The result of the transfer
+     *
+     * This function hands the result back to the submitter, either by invoking its
+     * <VoodooI2CControllerTransferCompletion> callback or by waking up the thread sleeping in <transferI2CGated>.
+     */
+
+    void completeTransfer(VoodooI2CControllerTransfer* transfer, IOReturn result);
+
+    /* Counts the bits a transfer puts on the bus
+     * @messages The messages to be transferred
+     * @number   The number of messages
+     *
+     * @return the number of SCL periods the transfer takes
+     */
+
+    UInt64 countTransferBits(VoodooI2CControllerBusMessage* messages, int number);
+
+    /* Estimates how long a transfer occupies the bus
+     * @messages The messages to be transferred
+     * @number   The number of messages
+     *
+     * @return the estimated bus time in nanoseconds
+     */
+
+    UInt64 estimateTransferTime(VoodooI2CControllerBusMessage* messages, int number);
+
+    /* Stops the iDMA channels at the end of a DMA run
+     *
+     * Once the run has completed cleanly, this function waits for the RX channel to drain the RX FIFO and copies
+     * the received bytes out of the bounce buffer into the read message.
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnTimeout* if the RX channel did not finish
+     */
+
+    IOReturn finishTransferDMA();
+
+    /* Disables the adapter after a transfer and translates the transfer state into a return code
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnNotReady* if the transfer should be retried,
+     * *kIOReturnError* otherwise
+     */
+
+    IOReturn finishTransferI2C();
 
     /* Requests the nub to fetch bus configuration values from the ACPI tables
      *
-     * This function evaluates the *SSCN* and *FMCN* methods in the ACPI tables via
-     * <VoodooI2CControllerNub::getACPIParams>.
+     * This function evaluates the *SSCN*, *FMCN*, *FPCN* and *HSCN* methods in the ACPI tables via
+     * <VoodooI2CControllerNub::getACPIParams>. Missing Fast-mode Plus and High-speed counts are computed
+     * from the input clock where it is known, otherwise those modes are left unavailable.
      *
      * @return *kIOReturnSuccess* if all desired values were obtained, *kIOReturnNotFound( if (some or all)
      * configuration values are missing
@@ -161,6 +465,59 @@ class EXPORT VoodooI2CControllerDriver : public IOService {
 
     IOReturn getBusConfig();
 
+    /* Computes how long to wait before checking again whether the bus has gone idle
+     *
+     * @return the interval in microseconds
+     */
+
+    UInt32 getBusIdleInterval();
+
+    /* Computes the SCL period of the configured speed mode from its high and low counts
+     *
+     * @return the SCL period in nanoseconds, the nominal period of the speed mode if the input clock is unknown
+     */
+
+    UInt32 getSCLPeriod();
+
+    /* Picks the fastest speed mode the controller supports that does not exceed a given bus speed
+     * @speed The desired bus speed in Hz
+     *
+     * @return the bus speed in Hz that will actually be used
+     */
+
+    UInt32 getSupportedBusSpeed(UInt32 speed);
+
+    /* Picks the speed mode a transfer runs at
+     * @speed The bus speed requested for the transfer in Hz, or 0 for the controller's *BusSpeed*
+     *
+     * Every device on the bus sees the clock of every transfer, so below high-speed mode the speed is limited to
+     * *BusSpeed* when it is set and to the lowest *sclHz* of the published nubs. High-speed transfers are preceded
+     * by a master code at fast mode speed, which the other devices ignore.
+     *
+     * @return the bus speed in Hz that will actually be used
+     */
+
+    UInt32 getTransferBusSpeed(UInt32 speed);
+
+    /* Maps a bus speed onto the speed bits of *DW_IC_CON*
+     * @speed A bus speed returned by <getSupportedBusSpeed>
+     *
+     * @return *DW_IC_CON_SPEED_STD*, *DW_IC_CON_SPEED_FAST* (which also covers Fast-mode Plus) or *DW_IC_CON_SPEED_HIGH*
+     */
+
+    UInt32 getSpeedConfig(UInt32 speed);
+
+    /* Computes the deadline of a transfer
+     * @estimate The estimated bus time of the transfer in nanoseconds
+     *
+     * The deadline allows for twice the estimated bus time plus *ClockStretchAllowance* microseconds
+     * (25ms by default) for slaves holding SCL low.
+     *
+     * @return the transfer deadline in microseconds
+     */
+
+    UInt32 getTransferTimeout(UInt64 estimate);
+
     /* Set bus configuration values in the IORegistry.
      *
      * @return *kIOReturnSuccess* if setting succeeded, *kIOReturnNoMemory* on allocation failure.
@@ -172,6 +529,26 @@ class EXPORT VoodooI2CControllerDriver : public IOService {
 
     void handleAbortI2C();
 
+    /* Handles the end of the active transfer on the work loop
+     *
+     * This function is called by <handleInterrupt> once *command_complete* has been set. If another transfer is
+     * queued, it is started before the finished transfer is handed back to its submitter so that the bus does
+     * not sit idle while completion callbacks run or waiting threads are woken up.
+     */
+
+    void handleTransferComplete();
+
+    /* Aborts the active transfer if the controller did not finish it in time
+     * @owner The owner of the timer
+     * @timer The timer armed in <startTransferI2C>
+     *
+     * If the timer was armed while waiting for the bus to go idle, the transfer is restarted instead.
+     *
+     * The time from the start of the transfer until the bus has been reinitialised is published as *RecoveryLatencyUs*.
+     */
+
+    void handleTransferTimeout(OSObject* owner, IOTimerEventSource* timer);
+
     /* Initialises the bus by writing in configuration values
      *
      * @return *kIOReturnSuccess* on successful initialisation, *kIOReturnError* otherwise
@@ -179,39 +556,62 @@ class EXPORT VoodooI2CControllerDriver : public IOService {
 
     IOReturn initialiseBus();
 
-    /* Prepares the driver for an I2C transfer routine
-     * @messages The messages to be transferred
-     * @number   The number of messages
+    /* Allocates the bounce buffer used by the iDMA channels
      *
-     * This function prepares the driver for an I2C transfer routine by requesting the bus to start a transfer.
-     * The driver then spins the current thread using *IOCommandGate::commandSleep* until either:
+     * The buffer is mapped with an <IODMACommand> so that the channels are given its address as seen by the
+     * controller, which goes through the system mapper when VT-d is enabled.
      *
-     * - The bus informs us that a successful transfer took place after calling <transferMessageToBus> in
-     *   <handleInterrupt>.<handleInterrupt>
-     * - The driver times out waiting for the bus to become ready.
-     * - The bus informs us that we cannot start a transfer due to an error.
+     * @return *kIOReturnSuccess* on success, *kIOReturnNoMemory* if the buffer could not be allocated
+     */
+
+    IOReturn initialiseDMA();
+
+    /* Forgets the shadow copies of the controller's registers
      *
-     * @return *kIOReturnSuccess* on successful preparation; *kIOReturnBusy* if the bus is busy;
-     * *kIOReturnTimeout* if the driver timed out waiting for the bus to become ready; *kIOReturnDeviceBusy*
-     * otherwise
+     * This is called whenever the controller may have lost its register contents, that is when the bus is
+     * reinitialised and on power state changes.
+     */
+
+    void invalidateShadowRegisters();
+
+    /* Publishes the transfer statistics in the IORegistry
+     *
+     * @return *kIOReturnSuccess* if setting succeeded, *kIOReturnNoMemory* on allocation failure.
      */
 
-    IOReturn prepareTransferI2C(VoodooI2CControllerBusMessage* messages, int* number);
+    IOReturn setBusStatisticsProperties();
 
     /* Traverses the IOACPIPlane to find children and publishes `VoodooI2CDeviceNub` entries
      * into the IORegistry for matching
      *
+     * Every nub is attached before any of them is started, so that the bus is already limited to the *sclHz* of
+     * its slowest device (see <getTransferBusSpeed>) by the time the first satellite talks to it.
+     *
      * @return *kIOReturnSuccess* on success, *kIOReturnError* otherwise
      */
 
     IOReturn publishNubs();
 
-    /* Determines what type of interrupt has fired
+    /* Moves a transfer on to its next run of messages
+     * @transfer The transfer whose current run has finished
+     *
+     * @return *true* if there are messages left for another slave device, *false* if the transfer is complete
+     */
+
+    bool nextTransferRun(VoodooI2CControllerTransfer* transfer);
+
+    /* Drives a short transfer to completion without interrupts
+     * @estimate The estimated bus time of the transfer in nanoseconds
      *
-     * @return *DW_IC_INT* status code
+     * This function spins on *DW_IC_RAW_INTR_STAT* and runs the transfer state machine from the current thread,
+     * saving the interrupt round trip for transfers that spend less time on the bus than the round trip itself.
+     * If the transfer takes much longer than estimated, the interrupts are unmasked and <handleInterrupt> takes over.
+     *
+     * @return *kIOReturnSuccess* if the transfer completed while polling, *kIOReturnTimeout* otherwise
      */
 
-    UInt32 readClearInterruptBits();
+    IOReturn pollTransferI2C(UInt64 estimate);
+
 
     /* Reads an I2C message from the bus
      *
@@ -221,12 +621,119 @@ class EXPORT VoodooI2CControllerDriver : public IOService {
 
     void readFromBus();
 
+    /* Reads a register of the controller
+     * @offset The offset of the register relative to the controller's base address
+     *
+     * The register window is cached in <register_base> for as long as the controller is powered so that the
+     * FIFO loops cost a single load per access. Without a mapping the read is passed to
+     * <VoodooI2CControllerNub::readRegister>. Debug builds also count the access for the *BusStatistics*, which
+     * is why <filterInterrupt> does not go through here.
+     *
+     * @return The value of the register
+     */
+
+    inline UInt32 readRegister(int offset);
+
+    /* Reads a register that only the driver writes
+     * @offset The offset of the register, one of *DW_IC_CON*, *DW_IC_TAR*, the SCL counts, *DW_IC_INTR_MASK*,
+     *  *DW_IC_RX_TL* or *DW_IC_TX_TL*
+     *
+     * The controller is only read if the shadow copy of the register is not valid.
+     *
+     * @return The value of the register
+     */
+
+    inline UInt32 readShadowedRegister(int offset);
+
+    /* Handles a byte of the length header of a length-prefixed read
+     * @message  The message being read
+     * @received The number of bytes of *message* received so far
+     * @length   The number of bytes of *message* still to be received
+     *
+     * Once the whole header of an *I2C_M_RECV_LEN* or *I2C_M_RECV_LEN16* message has been received, the read is
+     * shortened to the length reported by the slave (see <getReceiveLength>) and the rest of the read commands are
+     * released to <transferMessageToBus>. The message itself is left alone so that a retried run reads the header
+     * again, the length is only written back by <finishTransferI2C>.
+     *
+     * @return the number of bytes of *message* still to be received
+     */
+
+    UInt32 receiveLengthHeader(VoodooI2CControllerBusMessage* message, UInt32 received, UInt32 length);
+
+    /* Works out the length of a length-prefixed read from the header in its buffer
+     * @message The *I2C_M_RECV_LEN* or *I2C_M_RECV_LEN16* message whose header has been received
+     *
+     * @return the total number of bytes of the message, header included, bounded by its buffer length
+     */
+
+    UInt32 getReceiveLength(VoodooI2CControllerBusMessage* message);
+
+    /* Unmaps and frees the bounce buffer allocated by <initialiseDMA>
+     *
+     * This also cleans up after an <initialiseDMA> that failed half way through.
+     */
+
+    void releaseDMA();
+
     void releaseResources();
 
+    /* Probes every 7-bit address for a slave device
+     *
+     * This function is the gated version of <scanBus>.
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnNoMemory* if the property could not be allocated
+     */
+
+    IOReturn scanBusGated();
+
+    /* Starts a transfer and finishes it straight away if it completed without waiting for an interrupt
+     * @transfer The transfer to be run
+     */
+
+    void runTransfer(VoodooI2CControllerTransfer* transfer);
+
+    /* Adds the run that has just completed to the current calibration window
+     *
+     * The run is timed from the moment its first command is written to the STOP_DET that ended it. Only runs that
+     * were written to the TX FIFO in one go and whose replies fit in the RX FIFO are used, since those never wait
+     * for the driver while on the bus. Runs of fewer than 100 bits are left out as well.
+     */
+
+    void sampleBusTiming();
+
+    /* Runs one step of the transfer state machine
+     * @status The pending *DW_IC_INTR_* bits
+     *
+     * This function is called by <handleInterrupt> and, for polled transfers, by <pollTransferI2C>. It sets
+     * *command_complete* once the transfer has ended.
+     */
+
+    void serviceTransfer(UInt32 status);
+
+    /* Sets the controller's interrupt mask
+     * @mask The interrupts to unmask
+     *
+     * While a transfer is being polled, or serviced by <handleInterrupt>, only the software copy of the mask is
+     * updated.
+     */
+
+    void setInterruptMask(UInt32 mask);
+
+    /* Switches the controller to another bus speed
+     * @speed A bus speed returned by <getSupportedBusSpeed>
+     *
+     * The speed bits of *DW_IC_CON* and the fast mode counts (shared with Fast-mode Plus) can only be written
+     * while the adapter is disabled, so nothing is done if the controller already runs at *speed*.
+     */
+
+    void setBusSpeed(UInt32 speed);
+
     /* Requests the bus to prepare for an I2C transfer routine
      *
      * This function informs the bus that the driver would like to commence an I2C transfer routine. At this point
-     * we only inform the bus of the slave address and enable the bus.
+     * we only inform the bus of the slave address and enable the bus. On controllers configured with
+     * I2C_DYNAMIC_TAR_UPDATE (see *DynamicTARUpdate*) the adapter is left enabled between transfers and only the
+     * target address is reprogrammed.
      */
 
     void requestTransferI2C();
@@ -244,6 +751,93 @@ class EXPORT VoodooI2CControllerDriver : public IOService {
 
     IOReturn setPowerState(unsigned long whichState, IOService* whatDevice) override;
 
+    /* Gated version of <setPowerState>
+     * @whichState The index of the power state the bus is expected to enter
+     *
+     * Before powering the bus down, this function stops <submitTransferGated> from accepting new transfers and
+     * waits for the ones already queued to finish. Transfers are accepted again once the bus is powered up.
+     */
+
+    IOReturn setPowerStateGated(unsigned long* whichState);
+
+    /* Sets the FIFO thresholds for the transfer that is about to start
+     *
+     * The TX threshold is chosen so that the part of the transfer that does not fit in the FIFO can be written
+     * in a single refill where possible. The RX threshold starts at zero and is raised by
+     * <updateReceiveThreshold> as read commands are issued.
+     */
+
+    void setTransferThresholds();
+
+    /* Starts the next queued transfer if the bus is free
+     *
+     * Transfers that cannot be started, and polled transfers, are completed straight away. Once the queue has
+     * drained, the statistics are published and <setPowerStateGated> is woken up.
+     */
+
+    void startNextTransfer();
+
+    /* Programs a single-block iDMA channel and enables it
+     * @channel     *IDMA64_TX_CHANNEL* or *IDMA64_RX_CHANNEL*
+     * @source      The physical source address
+     * @destination The physical destination address
+     * @control     The *IDMA64C_CTLL_* bits
+     * @length      The number of source items
+     * @config      The *IDMA64C_CFGH_* bits
+     */
+
+    void startChannelDMA(UInt32 channel, UInt64 source, UInt64 destination, UInt32 control, UInt32 length, UInt32 config);
+
+    /* Hands the run to the iDMA channels
+     *
+     * This function writes every command of the run into the bounce buffer and lets the TX channel feed them to
+     * *DW_IC_DATA_CMD* while the RX channel collects the replies, so that only STOP_DET and TX_ABRT need
+     * servicing.
+     */
+
+    void startTransferDMA();
+
+    /* Starts an I2C transfer routine
+     * @transfer The transfer to be started
+     *
+     * This function prepares the driver for the next run of messages of *transfer* that share a slave address
+     * by requesting the bus to start a transfer.
+     * Transfers whose estimated bus time is within *PolledTransferBudget* microseconds are driven to completion
+     * by <pollTransferI2C>, in which case *command_complete* is set on return. Otherwise the transfer timeout is
+     * armed, the transfer proceeds in <handleInterrupt> and ends in either <handleTransferComplete> or
+     * <handleTransferTimeout>.
+     *
+     * @return *kIOReturnSuccess* if the transfer was started; *kIOReturnBusy* if the bus is busy or asleep
+     */
+
+    IOReturn startTransferI2C(VoodooI2CControllerTransfer* transfer);
+
+    /* Unmasks the interrupts that drive the transfer state machine
+     *
+     * If the whole command sequence fits in the TX FIFO, it is written before the interrupts are unmasked and
+     * TX_EMPTY is left masked, so that the transfer completes on a single STOP_DET interrupt. Otherwise the
+     * default interrupt mask is set and the FIFO is filled from <handleInterrupt>.
+     */
+
+    void startTransferInterrupts();
+
+    /* Disables the DMA handshake of the controller and both iDMA channels
+     *
+     * This must happen before a TX_ABRT is acknowledged, otherwise the TX channel carries on with the commands
+     * that were flushed by the abort.
+     */
+
+    void stopTransferDMA();
+
+    /* Appends a transfer to the submission queue
+     * @transfer The transfer to be queued
+     *
+     * @return *kIOReturnSuccess* if the transfer was queued, *kIOReturnBusy* if the controller is going to sleep or
+     * is asleep
+     */
+
+    IOReturn submitTransferGated(VoodooI2CControllerTransfer* transfer);
+
     /* Toggle the bus's enabled state
      * @param enabled The power state the bus is expected to enter represented by either
      *  *kVoodooI2CStateOn* or *kVoodooI2CStateOff*
@@ -273,29 +867,58 @@ class EXPORT VoodooI2CControllerDriver : public IOService {
 
     void toggleInterrupts(VoodooI2CState enabled);
 
-    /* Attempts an I2C transfer routine
-     * @messages The messages to be transferred
-     * @number   The number of messages
+    /* Queues an I2C transfer routine and sleeps until it has finished
+     * @transfer The transfer to be queued
 
-     @return returns kIOReturnSuccess on successful
+     @return the result of the transfer
      */
 
-    IOReturn transferI2CGated(VoodooI2CControllerBusMessage* messages, int* number);
+    IOReturn transferI2CGated(VoodooI2CControllerTransfer* transfer);
 
     /* Transfers an I2C message to the bus */
 
     void transferMessageToBus();
 
-    /* Waits for the bus not to be busy
+    /* Checks whether the bus is free for the next transfer
      *
-     * This function spins the current thread by a hardcoded amount using *IODelay* until the bus states that it is
-     * ready.
+     * The check is skipped if the previous transfer ended cleanly, as the bus was left idle by our own STOP.
+     * Otherwise *DW_IC_STATUS* is read once. The controller does not interrupt when ACTIVITY clears, so rather
+     * than spinning the caller the check is deferred: <startTransferI2C> arms the transfer timer and the
+     * transfer is restarted from <handleTransferTimeout>, leaving the work loop free in the meantime.
      *
-     * @return *kIOReturnSuccess* on success, *kIOReturnTimeout* otherwise
+     * @return *kIOReturnSuccess* if the bus is idle, *kIOReturnNotReady* if the check should be repeated later,
+     * *kIOReturnBusy* if the bus has not gone idle in time
      */
 
     IOReturn waitBusNotBusyI2C();
 
+    /* Raises the RX threshold to the number of bytes that are guaranteed to arrive
+     *
+     * The threshold is the number of outstanding read commands, capped at half the FIFO depth, so that reads
+     * drain in bursts instead of raising RX_FULL for every byte. The cap makes RX_FULL fire while the other half
+     * is still being received, so the read commands are refilled before the TX FIFO runs empty.
+     */
+
+    void updateReceiveThreshold();
+
+    /* Writes to a register of the controller
+     * @value  The value to be written
+     * @offset The offset of the register relative to the controller's base address
+     *
+     * See <readRegister>.
+     */
+
+    inline void writeRegister(UInt32 value, int offset);
+
+    /* Writes to a register that only the driver writes
+     * @value  The value to be written
+     * @offset The offset of the register, see <readShadowedRegister>
+     *
+     * The write is skipped if the shadow copy shows that the register already holds *value*.
+     */
+
+    inline void writeShadowedRegister(UInt32 value, int offset);
+
     /* Register and enable the interrupt for I2C bus
      *
      * Note: Do NOT call this function in direct interrupt context.
@@ -83,6 +83,46 @@ exit:
     return kIOReturnNotFound;
 }
 
+IOReturn VoodooI2CControllerNub::getACPIProperty(const char* property, UInt32* value) {
+    OSObject *object = NULL;
+    IOReturn status = kIOReturnNotFound;
+
+    if (controller->physical_device.acpi_device->evaluateObject("_DSD", &object) != kIOReturnSuccess || !object)
+        goto exit;
+
+    {
+        /* _DSD is a list of UUID and package pairs, the device properties package holds [name, value] pairs */
+        OSArray* dsd = OSDynamicCast(OSArray, object);
+        if (!dsd)
+            goto exit;
+
+        for (unsigned int i = 1; i < dsd->getCount(); i += 2) {
+            OSArray* properties = OSDynamicCast(OSArray, dsd->getObject(i));
+            if (!properties)
+                continue;
+
+            for (unsigned int j = 0; j < properties->getCount(); j++) {
+                OSArray* pair = OSDynamicCast(OSArray, properties->getObject(j));
+                if (!pair || pair->getCount() < 2)
+                    continue;
+
+                OSString* key = OSDynamicCast(OSString, pair->getObject(0));
+                OSNumber* number = OSDynamicCast(OSNumber, pair->getObject(1));
+                if (!key || !number || !key->isEqualTo(property))
+                    continue;
+
+                *value = number->unsigned32BitValue();
+                status = kIOReturnSuccess;
+                goto exit;
+            }
+        }
+    }
+
+exit:
+    OSSafeReleaseNULL(object);
+    return status;
+}
+
 IOReturn VoodooI2CControllerNub::getInterruptType(int source, int *interruptType) {
     return controller->physical_device.provider->getInterruptType(source, interruptType);
 }
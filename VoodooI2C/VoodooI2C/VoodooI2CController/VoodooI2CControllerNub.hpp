@@ -70,6 +70,15 @@ class EXPORT VoodooI2CControllerNub : public IOService {
 
     IOReturn getACPIParams(const char* method, UInt32* hcnt, UInt32* lcnt, UInt32* sda_hold);
 
+    /* Looks up an integer device property in the controller's _DSD package
+     * @property The name of the property, such as "i2c-scl-falling-time-ns"
+     * @value    Pointer to the *UInt32* where we store the value of the property
+     *
+     * @return *kIOReturnSuccess* if the property was found, *kIOReturnNotFound* otherwise
+     */
+
+    IOReturn getACPIProperty(const char* property, UInt32* value);
+
     /* Passes to <VoodooI2CController::readRegister>
      * @offset The offset of the register relative to the controller's base address
      *
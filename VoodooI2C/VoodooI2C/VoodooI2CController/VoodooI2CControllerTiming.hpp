@@ -0,0 +1,80 @@
+//
+//  VoodooI2CControllerTiming.hpp
+//  VoodooI2C
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+//  These helpers only depend on <stdint.h> so that scripts/run_tests.sh
+//  can check them on the host.
+//
+
+#ifndef VoodooI2CControllerTiming_h
+#define VoodooI2CControllerTiming_h
+
+#include <stdint.h>
+
+constexpr uint64_t KILO = 1000;
+constexpr uint64_t MICRO = 1000000;
+
+#define do_div(n, base)                                                        \
+  ({                                                                           \
+    uint32_t __base = (base);                                                  \
+    uint32_t __rem;                                                            \
+    __rem = (static_cast<uint64_t>(n)) % __base;                               \
+    (n) = (static_cast<uint64_t>(n)) / __base;                                 \
+    __rem;                                                                     \
+  })
+
+/*
+ * Same as above but for u64 dividends. divisor must be a 32-bit
+ * number.
+ */
+#define DIV_ROUND_CLOSEST_ULL(x, divisor)                                      \
+  ({                                                                           \
+    __decltype(divisor) __d = divisor;                                         \
+    unsigned long long _tmp = (x) + (__d) / 2;                                 \
+    do_div(_tmp, __d);                                                         \
+    _tmp;                                                                      \
+  })
+
+/*
+ * SCL high and low counts as computed by the Linux DesignWare driver. The
+ * fall time of the opposite edge is added to each period because the
+ * controller only starts counting once it has seen the line settle.
+ *
+ * Conditional expression:
+ *
+ *   IC_[FS]S_SCL_HCNT + (1+4+3) >= IC_CLK * tHIGH
+ *
+ * This is based on the DW manuals, and represents an ideal
+ * configuration.  The resulting I2C bus speed will be faster
+ * than any of the others.
+ *
+ *   IC_[FS]S_SCL_HCNT + 3 >= IC_CLK * (tHD;STA + tf)
+ *
+ * This is just experimental rule; the tHD;STA period turned
+ * out to be proportional to (_HCNT + 3).  With this setting,
+ * we could meet both tHIGH and tHD;STA timing specs.
+ */
+static inline uint32_t i2c_dw_scl_hcnt(uint32_t ic_clk, uint32_t tSYMBOL, uint32_t tf, int cond, int offset) {
+    if (cond)
+        return (uint32_t)DIV_ROUND_CLOSEST_ULL((uint64_t)ic_clk * tSYMBOL, MICRO) - 8 + offset;
+    else
+        return (uint32_t)DIV_ROUND_CLOSEST_ULL((uint64_t)ic_clk * (tSYMBOL + tf), MICRO) - 3 + offset;
+}
+
+/*
+ * Conditional expression:
+ *
+ *   IC_[FS]S_SCL_LCNT + 1 >= IC_CLK * (tLOW + tf)
+ *
+ * DW I2C core starts counting the SCL CNTs for the LOW period
+ * of the SCL clock (tLOW) as soon as it pulls the SCL line.
+ * In order to meet the tLOW timing spec, we need to take into
+ * account the fall time of SCL signal (tf).
+ */
+static inline uint32_t i2c_dw_scl_lcnt(uint32_t ic_clk, uint32_t tLOW, uint32_t tf, int offset) {
+    return (uint32_t)DIV_ROUND_CLOSEST_ULL((uint64_t)ic_clk * (tLOW + tf), MICRO) - 1 + offset;
+}
+
+#endif /* VoodooI2CControllerTiming_h */
@@ -76,6 +76,7 @@ bool VoodooI2CPCIController::start(IOService* provider) {
     }
 
     physical_device.pci_device = OSDynamicCast(IOPCIDevice, provider);
+    physical_device.has_idma = true;
 
     if (getACPIDevice() != kIOReturnSuccess) {
         IOLog("%s::%s Could not get ACPI device for PCI provider\n", getName(), physical_device.name);
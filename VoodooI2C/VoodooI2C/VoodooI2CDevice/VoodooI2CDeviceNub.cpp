@@ -18,6 +18,39 @@
 #define super IOService
 OSDefineMetaClassAndStructors(VoodooI2CDeviceNub, IOService);
 
+/* CRC-8 with polynomial x^8 + x^2 + x + 1 as used for the SMBus packet error code */
+static const UInt8 smbus_crc8_table[256] = {
+    0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d,
+    0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65, 0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d,
+    0xe0, 0xe7, 0xee, 0xe9, 0xfc, 0xfb, 0xf2, 0xf5, 0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+    0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85, 0xa8, 0xaf, 0xa6, 0xa1, 0xb4, 0xb3, 0xba, 0xbd,
+    0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2, 0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea,
+    0xb7, 0xb0, 0xb9, 0xbe, 0xab, 0xac, 0xa5, 0xa2, 0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+    0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32, 0x1f, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0d, 0x0a,
+    0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42, 0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a,
+    0x89, 0x8e, 0x87, 0x80, 0x95, 0x92, 0x9b, 0x9c, 0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+    0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec, 0xc1, 0xc6, 0xcf, 0xc8, 0xdd, 0xda, 0xd3, 0xd4,
+    0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c, 0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44,
+    0x19, 0x1e, 0x17, 0x10, 0x05, 0x02, 0x0b, 0x0c, 0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+    0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b, 0x76, 0x71, 0x78, 0x7f, 0x6a, 0x6d, 0x64, 0x63,
+    0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b, 0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13,
+    0xae, 0xa9, 0xa0, 0xa7, 0xb2, 0xb5, 0xbc, 0xbb, 0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+    0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb, 0xe6, 0xe1, 0xe8, 0xef, 0xfa, 0xfd, 0xf4, 0xf3,
+};
+
+static UInt8 smbusCRC8(UInt8 crc, const UInt8* data, UInt32 length) {
+    while (length--)
+        crc = smbus_crc8_table[crc ^ *data++];
+    return crc;
+}
+
+static UInt8 smbusMessagePEC(UInt8 pec, VoodooI2CControllerBusMessage* message) {
+    UInt8 address = (message->address << 1) | (message->flags & I2C_M_RD);
+
+    pec = smbusCRC8(pec, &address, 1);
+    return smbusCRC8(pec, message->buffer, message->length);
+}
+
 bool VoodooI2CDeviceNub::attach(IOService* provider, IOService* child) {
     const char *interruptMode = nullptr;
 
@@ -223,7 +256,8 @@ IOReturn VoodooI2CDeviceNub::getDeviceResources() {
     i2c_address = resource_parser.i2c_info.address;
     setProperty("i2cAddress", i2c_address, 16);
 
-    setProperty("sclHz", resource_parser.i2c_info.bus_speed, 32);
+    bus_speed = resource_parser.i2c_info.bus_speed;
+    setProperty("sclHz", bus_speed, 32);
 
     // There is actually no way to avoid APIC interrupt if it is valid
     if (validateAPICInterrupt() == kIOReturnSuccess)
@@ -288,6 +322,29 @@ IOWorkLoop* VoodooI2CDeviceNub::getWorkLoop(void) const {
     return work_loop;
 }
 
+IOReturn VoodooI2CDeviceNub::mapMemoryDescriptor(IOMemoryDescriptor* descriptor, IODirection direction, IOMemoryMap** map, UInt16* length) {
+    IOReturn ret;
+
+    if (!descriptor || !descriptor->getLength() || descriptor->getLength() > UINT16_MAX)
+        return kIOReturnBadArgument;
+
+    if ((descriptor->getDirection() & direction) != direction)
+        return kIOReturnBadArgument;
+
+    ret = descriptor->prepare(direction);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    *map = descriptor->createMappingInTask(kernel_task, 0, kIOMapAnywhere);
+    if (!*map) {
+        descriptor->complete(direction);
+        return kIOReturnNoMemory;
+    }
+
+    *length = descriptor->getLength();
+    return kIOReturnSuccess;
+}
+
 IOReturn VoodooI2CDeviceNub::readI2C(UInt8* values, UInt16 length) {
     return command_gate->attemptAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CDeviceNub::readI2CGated), values, &length);
 }
@@ -306,7 +363,56 @@ IOReturn VoodooI2CDeviceNub::readI2CGated(UInt8* values, UInt16* length) {
         },
     };
 
-    return controller->transferI2C(msgs, 1);
+    return controller->transferI2C(msgs, 1, bus_speed);
+}
+
+IOReturn VoodooI2CDeviceNub::readI2C(IOMemoryDescriptor* values) {
+    IOMemoryMap* map;
+    UInt16 length;
+
+    IOReturn ret = mapMemoryDescriptor(values, kIODirectionIn, &map, &length);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    ret = readI2C(reinterpret_cast<UInt8*>(map->getVirtualAddress()), length);
+
+    unmapMemoryDescriptor(values, kIODirectionIn, map);
+    return ret;
+}
+
+IOReturn VoodooI2CDeviceNub::readLengthPrefixedI2C(UInt8* values, UInt16* length, UInt16 header_length) {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CDeviceNub::readLengthPrefixedI2CGated), values, length, &header_length);
+}
+
+IOReturn VoodooI2CDeviceNub::readLengthPrefixedI2CGated(UInt8* values, UInt16* length, UInt16* header_length) {
+    UInt16 flags = I2C_M_RD;
+
+    if (*header_length == 1)
+        flags |= I2C_M_RECV_LEN;
+    else if (*header_length == 2)
+        flags |= I2C_M_RECV_LEN16;
+    else
+        return kIOReturnBadArgument;
+
+    if (*length <= *header_length)
+        return kIOReturnBadArgument;
+
+    if (use_10bit_addressing)
+        flags |= I2C_M_TEN;
+    VoodooI2CControllerBusMessage msgs[] = {
+        {
+            .address = i2c_address,
+            .buffer = values,
+            .flags = flags,
+            .length = *length,
+        },
+    };
+
+    IOReturn ret = controller->transferI2C(msgs, 1, bus_speed);
+    if (ret == kIOReturnSuccess)
+        *length = msgs[0].length;
+
+    return ret;
 }
 
 IOReturn VoodooI2CDeviceNub::registerInterrupt(int source, OSObject *target, IOInterruptAction handler, void *refcon) {
@@ -329,6 +435,243 @@ void VoodooI2CDeviceNub::releaseResources() {
     OSSafeReleaseNULL(work_loop);
 }
 
+void VoodooI2CDeviceNub::setSMBusPEC(bool enabled) {
+    smbus_pec = enabled;
+}
+
+IOReturn VoodooI2CDeviceNub::smbusProcessCall(UInt8 command, UInt16 value, UInt16* result) {
+    VoodooI2CSMBusData data;
+
+    data.word = value;
+    IOReturn ret = smbusTransfer(I2C_SMBUS_WRITE, command, I2C_SMBUS_PROC_CALL, &data);
+    if (ret == kIOReturnSuccess)
+        *result = data.word;
+
+    return ret;
+}
+
+IOReturn VoodooI2CDeviceNub::smbusQuick(UInt8 read_write) {
+    return smbusTransfer(read_write, 0, I2C_SMBUS_QUICK, nullptr);
+}
+
+IOReturn VoodooI2CDeviceNub::smbusReadBlockData(UInt8 command, UInt8* values, UInt8* length) {
+    VoodooI2CSMBusData data;
+
+    IOReturn ret = smbusTransfer(I2C_SMBUS_READ, command, I2C_SMBUS_BLOCK_DATA, &data);
+    if (ret == kIOReturnSuccess) {
+        memcpy(values, &data.block[1], data.block[0]);
+        *length = data.block[0];
+    }
+
+    return ret;
+}
+
+IOReturn VoodooI2CDeviceNub::smbusReadByte(UInt8* value) {
+    VoodooI2CSMBusData data;
+
+    IOReturn ret = smbusTransfer(I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &data);
+    if (ret == kIOReturnSuccess)
+        *value = data.byte;
+
+    return ret;
+}
+
+IOReturn VoodooI2CDeviceNub::smbusReadByteData(UInt8 command, UInt8* value) {
+    VoodooI2CSMBusData data;
+
+    IOReturn ret = smbusTransfer(I2C_SMBUS_READ, command, I2C_SMBUS_BYTE_DATA, &data);
+    if (ret == kIOReturnSuccess)
+        *value = data.byte;
+
+    return ret;
+}
+
+IOReturn VoodooI2CDeviceNub::smbusReadWordData(UInt8 command, UInt16* value) {
+    VoodooI2CSMBusData data;
+
+    IOReturn ret = smbusTransfer(I2C_SMBUS_READ, command, I2C_SMBUS_WORD_DATA, &data);
+    if (ret == kIOReturnSuccess)
+        *value = data.word;
+
+    return ret;
+}
+
+IOReturn VoodooI2CDeviceNub::smbusTransfer(UInt8 read_write, UInt8 command, UInt32 protocol, VoodooI2CSMBusData* data) {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CDeviceNub::smbusTransferGated), &read_write, &command, &protocol, data);
+}
+
+IOReturn VoodooI2CDeviceNub::smbusTransferGated(UInt8* read_write, UInt8* command, UInt32* protocol, VoodooI2CSMBusData* data) {
+    UInt8 write_buffer[I2C_SMBUS_BLOCK_MAX + 3];
+    UInt8 read_buffer[I2C_SMBUS_BLOCK_MAX + 2];
+    bool read = *read_write == I2C_SMBUS_READ;
+    UInt8 partial_pec = 0;
+    int number = read ? 2 : 1;
+    IOReturn ret;
+
+    /* The PEC covers the 7-bit address byte, SMBus has no notion of 10-bit addresses */
+    if (use_10bit_addressing)
+        return kIOReturnUnsupported;
+
+    VoodooI2CControllerBusMessage msgs[] = {
+        {
+            .address = i2c_address,
+            .buffer = write_buffer,
+            .flags = 0,
+            .length = 1,
+        },
+        {
+            .address = i2c_address,
+            .buffer = read_buffer,
+            .flags = I2C_M_RD,
+            .length = 0,
+        },
+    };
+    VoodooI2CControllerBusMessage* first = msgs;
+
+    write_buffer[0] = *command;
+
+    switch (*protocol) {
+        case I2C_SMBUS_QUICK:
+            /* Without quick command support the controller would send a byte of data along with a quick write */
+            if (!read && !(controller->bus_device.functionality & I2C_FUNC_SMBUS_QUICK))
+                return kIOReturnUnsupported;
+            msgs[0].flags = read ? I2C_M_RD : 0;
+            msgs[0].length = 0;
+            number = 1;
+            read = false;
+            break;
+        case I2C_SMBUS_BYTE:
+            /* A byte write sends the value in place of the command */
+            if (read) {
+                first = &msgs[1];
+                msgs[1].length = 1;
+            }
+            number = 1;
+            break;
+        case I2C_SMBUS_BYTE_DATA:
+            if (read) {
+                msgs[1].length = 1;
+            } else {
+                msgs[0].length = 2;
+                write_buffer[1] = data->byte;
+            }
+            break;
+        case I2C_SMBUS_WORD_DATA:
+            if (read) {
+                msgs[1].length = 2;
+            } else {
+                msgs[0].length = 3;
+                write_buffer[1] = data->word & 0xff;
+                write_buffer[2] = data->word >> 8;
+            }
+            break;
+        case I2C_SMBUS_PROC_CALL:
+            read = true;
+            number = 2;
+            msgs[0].length = 3;
+            msgs[1].length = 2;
+            write_buffer[1] = data->word & 0xff;
+            write_buffer[2] = data->word >> 8;
+            break;
+        case I2C_SMBUS_BLOCK_DATA:
+            if (read) {
+                /* The slave reports the block length in its first byte */
+                msgs[1].flags |= I2C_M_RECV_LEN;
+                msgs[1].length = I2C_SMBUS_BLOCK_MAX + 1;
+            } else {
+                if (data->block[0] == 0 || data->block[0] > I2C_SMBUS_BLOCK_MAX)
+                    return kIOReturnBadArgument;
+                msgs[0].length = data->block[0] + 2;
+                memcpy(&write_buffer[1], data->block, data->block[0] + 1);
+            }
+            break;
+        default:
+            return kIOReturnUnsupported;
+    }
+
+    if (smbus_pec && *protocol != I2C_SMBUS_QUICK) {
+        /* Append the PEC to a lone write, otherwise start it off with the write preceding the read */
+        if (!(first[0].flags & I2C_M_RD)) {
+            if (number == 1)
+                write_buffer[first[0].length++] = smbusMessagePEC(0, &first[0]);
+            else
+                partial_pec = smbusMessagePEC(0, &first[0]);
+        }
+
+        /* Ask the slave for its PEC after the read */
+        if (first[number - 1].flags & I2C_M_RD) {
+            first[number - 1].flags |= I2C_CLIENT_PEC;
+            first[number - 1].length++;
+        }
+    }
+
+    ret = controller->transferI2C(first, number, bus_speed);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    if (!read)
+        return kIOReturnSuccess;
+
+    if (smbus_pec && *protocol != I2C_SMBUS_QUICK) {
+        VoodooI2CControllerBusMessage* last = &first[number - 1];
+
+        last->length--;
+        if (read_buffer[last->length] != smbusMessagePEC(partial_pec, last)) {
+            IOLog("%s::%s SMBus PEC mismatch\n", controller_name, getName());
+            return kIOReturnIOError;
+        }
+    }
+
+    switch (*protocol) {
+        case I2C_SMBUS_BYTE:
+        case I2C_SMBUS_BYTE_DATA:
+            data->byte = read_buffer[0];
+            break;
+        case I2C_SMBUS_WORD_DATA:
+        case I2C_SMBUS_PROC_CALL:
+            data->word = read_buffer[0] | (read_buffer[1] << 8);
+            break;
+        case I2C_SMBUS_BLOCK_DATA:
+            /* The controller clamps the length, so make sure the count the slave sent was valid in the first place */
+            if (read_buffer[0] == 0 || read_buffer[0] > I2C_SMBUS_BLOCK_MAX)
+                return kIOReturnError;
+            memcpy(data->block, read_buffer, read_buffer[0] + 1);
+            break;
+    }
+
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooI2CDeviceNub::smbusWriteBlockData(UInt8 command, UInt8* values, UInt8 length) {
+    VoodooI2CSMBusData data;
+
+    if (length == 0 || length > I2C_SMBUS_BLOCK_MAX)
+        return kIOReturnBadArgument;
+
+    data.block[0] = length;
+    memcpy(&data.block[1], values, length);
+
+    return smbusTransfer(I2C_SMBUS_WRITE, command, I2C_SMBUS_BLOCK_DATA, &data);
+}
+
+IOReturn VoodooI2CDeviceNub::smbusWriteByte(UInt8 value) {
+    return smbusTransfer(I2C_SMBUS_WRITE, value, I2C_SMBUS_BYTE, nullptr);
+}
+
+IOReturn VoodooI2CDeviceNub::smbusWriteByteData(UInt8 command, UInt8 value) {
+    VoodooI2CSMBusData data;
+
+    data.byte = value;
+    return smbusTransfer(I2C_SMBUS_WRITE, command, I2C_SMBUS_BYTE_DATA, &data);
+}
+
+IOReturn VoodooI2CDeviceNub::smbusWriteWordData(UInt8 command, UInt16 value) {
+    VoodooI2CSMBusData data;
+
+    data.word = value;
+    return smbusTransfer(I2C_SMBUS_WRITE, command, I2C_SMBUS_WORD_DATA, &data);
+}
+
 bool VoodooI2CDeviceNub::start(IOService* provider) {
     if (!super::start(provider))
         return false;
@@ -371,6 +714,11 @@ IOReturn VoodooI2CDeviceNub::unregisterInterrupt(int source) {
     }
 }
 
+void VoodooI2CDeviceNub::unmapMemoryDescriptor(IOMemoryDescriptor* descriptor, IODirection direction, IOMemoryMap* map) {
+    map->release();
+    descriptor->complete(direction);
+}
+
 IOReturn VoodooI2CDeviceNub::writeI2C(UInt8 *values, UInt16 length) {
     return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CDeviceNub::writeI2CGated), values, &length);
 }
@@ -388,7 +736,27 @@ IOReturn VoodooI2CDeviceNub::writeI2CGated(UInt8* values, UInt16* length) {
             .length = *length,
         },
     };
-    return controller->transferI2C(msgs, 1);
+    return controller->transferI2C(msgs, 1, bus_speed);
+}
+
+IOReturn VoodooI2CDeviceNub::writeI2C(IOMemoryDescriptor* values) {
+    IOMemoryMap* map;
+    UInt16 length;
+
+    IOReturn ret = mapMemoryDescriptor(values, kIODirectionOut, &map, &length);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    ret = writeI2C(reinterpret_cast<UInt8*>(map->getVirtualAddress()), length);
+
+    unmapMemoryDescriptor(values, kIODirectionOut, map);
+    return ret;
+}
+
+IOReturn VoodooI2CDeviceNub::writeI2CV(const VoodooI2CIOVector* vectors, int count) {
+    UInt16 read_length = 0;
+
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CDeviceNub::writeReadI2CVGated), const_cast<VoodooI2CIOVector*>(vectors), &count, nullptr, &read_length);
 }
 
 IOReturn VoodooI2CDeviceNub::writeReadI2C(UInt8 *write_buffer, UInt16 write_length, UInt8 *read_buffer, UInt16 read_length) {
@@ -417,5 +785,67 @@ IOReturn VoodooI2CDeviceNub::writeReadI2CGated(UInt8* write_buffer, UInt16* writ
             .length = *read_length,
         }
     };
-    return controller->transferI2C(msgs, 2);
+    return controller->transferI2C(msgs, 2, bus_speed);
+}
+
+IOReturn VoodooI2CDeviceNub::writeReadI2C(IOMemoryDescriptor* write_buffer, IOMemoryDescriptor* read_buffer) {
+    IOMemoryMap *write_map, *read_map;
+    UInt16 write_length, read_length;
+
+    IOReturn ret = mapMemoryDescriptor(write_buffer, kIODirectionOut, &write_map, &write_length);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    ret = mapMemoryDescriptor(read_buffer, kIODirectionIn, &read_map, &read_length);
+    if (ret != kIOReturnSuccess)
+        goto exit;
+
+    ret = writeReadI2C(reinterpret_cast<UInt8*>(write_map->getVirtualAddress()), write_length,
+                       reinterpret_cast<UInt8*>(read_map->getVirtualAddress()), read_length);
+
+    unmapMemoryDescriptor(read_buffer, kIODirectionIn, read_map);
+exit:
+    unmapMemoryDescriptor(write_buffer, kIODirectionOut, write_map);
+    return ret;
+}
+
+IOReturn VoodooI2CDeviceNub::writeReadI2CV(const VoodooI2CIOVector* vectors, int count, UInt8* read_buffer, UInt16 read_length) {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CDeviceNub::writeReadI2CVGated), const_cast<VoodooI2CIOVector*>(vectors), &count, read_buffer, &read_length);
+}
+
+IOReturn VoodooI2CDeviceNub::writeReadI2CVGated(const VoodooI2CIOVector* vectors, int* count, UInt8* read_buffer, UInt16* read_length) {
+    VoodooI2CControllerBusMessage msgs[I2C_IOV_MAX + 1];
+    UInt16 flags = 0;
+    int number = 0;
+
+    if (*count < 0 || *count > I2C_IOV_MAX)
+        return kIOReturnBadArgument;
+
+    if (use_10bit_addressing)
+        flags = I2C_M_TEN;
+
+    /* Each buffer after the first carries on the same write, the controller walks them in place */
+    for (int i = 0; i < *count; i++) {
+        if (!vectors[i].length)
+            continue;
+
+        msgs[number].address = i2c_address;
+        msgs[number].buffer = vectors[i].buffer;
+        msgs[number].flags = number ? (flags | I2C_M_NOSTART) : flags;
+        msgs[number].length = vectors[i].length;
+        number++;
+    }
+
+    if (!number)
+        return kIOReturnBadArgument;
+
+    if (read_buffer) {
+        msgs[number].address = i2c_address;
+        msgs[number].buffer = read_buffer;
+        msgs[number].flags = flags | I2C_M_RD;
+        msgs[number].length = *read_length;
+        number++;
+    }
+
+    return controller->transferI2C(msgs, number, bus_speed);
 }
@@ -11,6 +11,7 @@
 
 #include <IOKit/IOLib.h>
 #include <IOKit/IOKitKeys.h>
+#include <IOKit/IOMemoryDescriptor.h>
 #include <IOKit/IOService.h>
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
 #include "../../../Dependencies/VoodooGPIO/VoodooGPIO/VoodooGPIO.hpp"
@@ -28,6 +29,31 @@
 #define HIDG_DESC_INDEX 1
 #define TP7G_RESOURCES_INDEX 1
 
+#define I2C_SMBUS_BLOCK_MAX 32
+
+#define I2C_IOV_MAX 8
+
+#define I2C_SMBUS_READ 1
+#define I2C_SMBUS_WRITE 0
+
+#define I2C_SMBUS_QUICK 0
+#define I2C_SMBUS_BYTE 1
+#define I2C_SMBUS_BYTE_DATA 2
+#define I2C_SMBUS_WORD_DATA 3
+#define I2C_SMBUS_PROC_CALL 4
+#define I2C_SMBUS_BLOCK_DATA 5
+
+typedef union {
+    UInt8 byte;
+    UInt16 word;
+    UInt8 block[I2C_SMBUS_BLOCK_MAX + 2];  // block[0] holds the length
+} VoodooI2CSMBusData;
+
+typedef struct {
+    UInt8* buffer;
+    UInt16 length;
+} VoodooI2CIOVector;
+
 class VoodooI2CControllerDriver;
 
 /* Implements a device nub to which an instance of a device driver may attach. Examples include <VoodooI2CHIDDevice>
@@ -109,6 +135,33 @@ class EXPORT VoodooI2CDeviceNub : public IOService {
 
     IOReturn readI2C(UInt8* values, UInt16 length);
 
+    /* Transmits an I2C read request into a memory descriptor to the slave device
+     * @values The memory descriptor that the returned data is to be written into, its length is the length of the message
+     *
+     * This function pins and maps the descriptor for the duration of the transfer only, the data is read straight into
+     * the mapping. WARNING: This function is not safe to call from an interrupt context.
+     *
+     * @return *kIOReturnBadArgument* if the descriptor is empty, longer than 65535 bytes or cannot be read into,
+     * *kIOReturnNoMemory* if it cannot be mapped, see <readI2C> otherwise
+     */
+
+    IOReturn readI2C(IOMemoryDescriptor* values);
+
+    /* Transmits a length-prefixed I2C read request to the slave device
+     * @values        The buffer that the returned data is to be written into
+     * @length        The length of the buffer, set to the number of bytes read on return
+     * @header_length The length of the header the slave sends first, 1 for an SMBus block count or 2 for a
+     *                little-endian HID over I2C report length (which includes the header itself)
+     *
+     * This function reads the header and then only as many bytes as the slave announced in it, all in a single
+     * transaction. At least one byte past the header is always read, and the read never exceeds *length* bytes.
+     * WARNING: This function is not safe to call from an interrupt context.
+     *
+     * @return *kIOReturnSuccess* upon a successful read, *kIOReturnBadArgument* if the header length is not supported or the buffer cannot hold more than the header, *kIOReturnBusy* if the bus is busy, *kIOReturnTimeout* if the controller driver waits too long for the controller to assert its interrupt line, *kIOReturnError* otherwise
+     */
+
+    IOReturn readLengthPrefixedI2C(UInt8* values, UInt16* length, UInt16 header_length);
+
     /* Registers a slave for interrupts
      * @source The index of the interrupt source in the case of APIC interrupts
      * @target The slave driver
@@ -123,6 +176,119 @@ class EXPORT VoodooI2CDeviceNub : public IOService {
 
     IOReturn registerInterrupt(int source, OSObject *target, IOInterruptAction handler, void *refcon) override;
 
+    /* Enables or disables SMBus packet error checking
+     * @enabled Whether the SMBus operations should append and verify a PEC byte
+     */
+
+    void setSMBusPEC(bool enabled);
+
+    /* Performs an SMBus process call
+     * @command The command code
+     * @value   The word to be written
+     * @result  The word returned by the slave device
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnIOError* if the PEC does not match, see <smbusTransfer> otherwise
+     */
+
+    IOReturn smbusProcessCall(UInt8 command, UInt16 value, UInt16* result);
+
+    /* Performs an SMBus quick command
+     * @read_write *I2C_SMBUS_READ* or *I2C_SMBUS_WRITE*, transmitted as the R/W bit
+     *
+     * @return see <smbusTransfer>
+     */
+
+    IOReturn smbusQuick(UInt8 read_write);
+
+    /* Performs an SMBus block read
+     * @command The command code
+     * @values  The buffer that the block is to be written into, at least *I2C_SMBUS_BLOCK_MAX* bytes long
+     * @length  The length of the block
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnIOError* if the PEC does not match, see <smbusTransfer> otherwise
+     */
+
+    IOReturn smbusReadBlockData(UInt8 command, UInt8* values, UInt8* length);
+
+    /* Performs an SMBus receive byte
+     * @value The byte returned by the slave device
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnIOError* if the PEC does not match, see <smbusTransfer> otherwise
+     */
+
+    IOReturn smbusReadByte(UInt8* value);
+
+    /* Performs an SMBus read byte
+     * @command The command code
+     * @value   The byte returned by the slave device
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnIOError* if the PEC does not match, see <smbusTransfer> otherwise
+     */
+
+    IOReturn smbusReadByteData(UInt8 command, UInt8* value);
+
+    /* Performs an SMBus read word
+     * @command The command code
+     * @value   The word returned by the slave device
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnIOError* if the PEC does not match, see <smbusTransfer> otherwise
+     */
+
+    IOReturn smbusReadWordData(UInt8 command, UInt16* value);
+
+    /* Performs an SMBus operation
+     * @read_write *I2C_SMBUS_READ* or *I2C_SMBUS_WRITE*
+     * @command    The command code, or the byte to be sent for an *I2C_SMBUS_BYTE* write
+     * @protocol   One of the *I2C_SMBUS_* protocols
+     * @data       The data to be written or the buffer the returned data is to be written into
+     *
+     * Each operation is carried out as a single gated transaction on the controller. If enabled with
+     * <setSMBusPEC>, the packet error code is appended to writes and verified on reads.
+     * WARNING: This function is not safe to call from an interrupt context.
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnUnsupported* if the protocol is not supported,
+     * *kIOReturnBadArgument* if a block length is invalid, *kIOReturnIOError* if the PEC does not match,
+     * see <writeReadI2C> otherwise
+     */
+
+    IOReturn smbusTransfer(UInt8 read_write, UInt8 command, UInt32 protocol, VoodooI2CSMBusData* data);
+
+    /* Performs an SMBus block write
+     * @command The command code
+     * @values  The block to be written
+     * @length  The length of the block, at most *I2C_SMBUS_BLOCK_MAX*
+     *
+     * @return see <smbusTransfer>
+     */
+
+    IOReturn smbusWriteBlockData(UInt8 command, UInt8* values, UInt8 length);
+
+    /* Performs an SMBus send byte
+     * @value The byte to be written
+     *
+     * @return see <smbusTransfer>
+     */
+
+    IOReturn smbusWriteByte(UInt8 value);
+
+    /* Performs an SMBus write byte
+     * @command The command code
+     * @value   The byte to be written
+     *
+     * @return see <smbusTransfer>
+     */
+
+    IOReturn smbusWriteByteData(UInt8 command, UInt8 value);
+
+    /* Performs an SMBus write word
+     * @command The command code
+     * @value   The word to be written
+     *
+     * @return see <smbusTransfer>
+     */
+
+    IOReturn smbusWriteWordData(UInt8 command, UInt16 value);
+
     /* Starts the device nub
      * @provider The controller that drives this slave device
      *
@@ -160,6 +326,31 @@ class EXPORT VoodooI2CDeviceNub : public IOService {
 
     IOReturn writeI2C(UInt8* values, UInt16 length);
 
+    /* Transmits an I2C write request from a memory descriptor to the slave device
+     * @values The memory descriptor containing the message to be written
+     *
+     * This function pins and maps the descriptor for the duration of the transfer only, the data is written straight
+     * from the mapping. WARNING: This function is not safe to call from an interrupt context.
+     *
+     * @return *kIOReturnBadArgument* if the descriptor is empty, longer than 65535 bytes or cannot be written from,
+     * *kIOReturnNoMemory* if it cannot be mapped, see <writeI2C> otherwise
+     */
+
+    IOReturn writeI2C(IOMemoryDescriptor* values);
+
+    /* Transmits an I2C write request gathered from several buffers to the slave device
+     * @vectors The buffers containing the message to be written, in order
+     * @count   The number of buffers, at most *I2C_IOV_MAX*
+     *
+     * This function writes the buffers back to back as a single message, so that a command header and its payload
+     * need not be copied into one buffer first. Empty buffers are skipped. WARNING: This function is not safe to call
+     * from an interrupt context.
+     *
+     * @return *kIOReturnBadArgument* if there are too many buffers or all of them are empty, see <writeI2C> otherwise
+     */
+
+    IOReturn writeI2CV(const VoodooI2CIOVector* vectors, int count);
+
     /* Transmits an I2C write-read request to the slave device
      * @write_buffer A buffer containing the message to be written
      * @write_length The length of the write message
@@ -174,6 +365,33 @@ class EXPORT VoodooI2CDeviceNub : public IOService {
 
     IOReturn writeReadI2C(UInt8* write_buffer, UInt16 write_length, UInt8* read_buffer, UInt16 read_length);
 
+    /* Transmits an I2C write-read request between memory descriptors to the slave device
+     * @write_buffer The memory descriptor containing the message to be written
+     * @read_buffer  The memory descriptor that the returned data is to be written into
+     *
+     * This function is the memory descriptor counterpart of <writeReadI2C>, see <readI2C> and <writeI2C>. WARNING: This
+     * function is not safe to call from an interrupt context.
+     *
+     * @return *kIOReturnBadArgument* if either descriptor is unsuitable, *kIOReturnNoMemory* if either cannot be mapped,
+     * see <writeReadI2C> otherwise
+     */
+
+    IOReturn writeReadI2C(IOMemoryDescriptor* write_buffer, IOMemoryDescriptor* read_buffer);
+
+    /* Transmits an I2C write-read request whose write is gathered from several buffers to the slave device
+     * @vectors     The buffers containing the message to be written, in order
+     * @count       The number of buffers, at most *I2C_IOV_MAX*
+     * @read_buffer The buffer that the returned data is to be written into
+     * @read_length The length of the read message
+     *
+     * This function is the scatter-gather counterpart of <writeReadI2C>, see <writeI2CV>. WARNING: This function is
+     * not safe to call from an interrupt context.
+     *
+     * @return *kIOReturnBadArgument* if there are too many buffers or all of them are empty, see <writeReadI2C> otherwise
+     */
+
+    IOReturn writeReadI2CV(const VoodooI2CIOVector* vectors, int count, UInt8* read_buffer, UInt16 read_length);
+
     /* Evaluate _DSM for specific GUID and function index. Assume Revision ID is 1 for now.
      * @uuid Human-readable GUID string (big-endian)
      * @index Function index
@@ -195,6 +413,7 @@ class EXPORT VoodooI2CDeviceNub : public IOService {
 
  private:
     IOACPIPlatformDevice* acpi_device;
+    UInt32 bus_speed {0};
     IOCommandGate* command_gate;
     VoodooI2CControllerDriver* controller;
     const char* controller_name;
@@ -204,6 +423,7 @@ class EXPORT VoodooI2CDeviceNub : public IOService {
     UInt8 i2c_address;
     bool has_apic_interrupts {false};
     bool has_gpio_interrupts {false};
+    bool smbus_pec {false};
     bool use_10bit_addressing {false};
     IOWorkLoop* work_loop = nullptr;
 
@@ -242,6 +462,18 @@ class EXPORT VoodooI2CDeviceNub : public IOService {
 
     VoodooGPIO* getGPIOController();
 
+    /* Pins and maps a memory descriptor into the kernel for a transfer
+     * @descriptor The memory descriptor
+     * @direction  *kIODirectionIn* if the transfer reads into the descriptor, *kIODirectionOut* if it writes from it
+     * @map        The mapping will be stored here, to be released with <unmapMemoryDescriptor>
+     * @length     The length of the descriptor will be stored here
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnBadArgument* if the descriptor is empty, longer than 65535 bytes
+     * or does not allow *direction*, *kIOReturnNoMemory* if it cannot be mapped, the result of *prepare* otherwise
+     */
+
+    IOReturn mapMemoryDescriptor(IOMemoryDescriptor* descriptor, IODirection direction, IOMemoryMap** map, UInt16* length);
+
     /* Transmits an I2C read request to the slave device
      * @values The buffer that the returned data is to be written into
      * @length The length of the message
@@ -253,6 +485,18 @@ class EXPORT VoodooI2CDeviceNub : public IOService {
 
     IOReturn readI2CGated(UInt8* values, UInt16* length);
 
+    /* Transmits a length-prefixed I2C read request to the slave device
+     * @values        The buffer that the returned data is to be written into
+     * @length        The length of the buffer, set to the number of bytes read on return
+     * @header_length The length of the header the slave sends first
+     *
+     * This function is the gated version of <readLengthPrefixedI2C>.
+     *
+     * @return *kIOReturnSuccess* upon a successful read, *kIOReturnBadArgument* if the header length is not supported or the buffer cannot hold more than the header, *kIOReturnBusy* if the bus is busy, *kIOReturnTimeout* if the controller driver waits too long for the controller to assert its interrupt line, *kIOReturnError* otherwise
+     */
+
+    IOReturn readLengthPrefixedI2CGated(UInt8* values, UInt16* length, UInt16* header_length);
+
     /* Releases resources allocated in <start>
      *
      * This function is called during a graceful exit from <start> and during
@@ -261,6 +505,27 @@ class EXPORT VoodooI2CDeviceNub : public IOService {
 
     void releaseResources();
 
+    /* Releases a mapping made by <mapMemoryDescriptor> and unpins its memory descriptor
+     * @descriptor The memory descriptor
+     * @direction  The direction the descriptor was mapped with
+     * @map        The mapping
+     */
+
+    void unmapMemoryDescriptor(IOMemoryDescriptor* descriptor, IODirection direction, IOMemoryMap* map);
+
+    /* Performs an SMBus operation
+     * @read_write *I2C_SMBUS_READ* or *I2C_SMBUS_WRITE*
+     * @command    The command code
+     * @protocol   One of the *I2C_SMBUS_* protocols
+     * @data       The data to be written or the buffer the returned data is to be written into
+     *
+     * This function is the gated version of <smbusTransfer>.
+     *
+     * @return see <smbusTransfer>
+     */
+
+    IOReturn smbusTransferGated(UInt8* read_write, UInt8* command, UInt32* protocol, VoodooI2CSMBusData* data);
+
     /* Transmits an I2C write request to the slave device
      * @values A buffer containing the message to be written
      * @length The length of the message
@@ -285,6 +550,19 @@ class EXPORT VoodooI2CDeviceNub : public IOService {
 
     IOReturn writeReadI2CGated(UInt8* write_buffer, UInt16* write_length, UInt8* read_buffer, UInt16* read_length);
 
+    /* Transmits an I2C write or write-read request whose write is gathered from several buffers to the slave device
+     * @vectors     The buffers containing the message to be written, in order
+     * @count       The number of buffers
+     * @read_buffer The buffer that the returned data is to be written into, *NULL* for a plain write
+     * @read_length The length of the read message
+     *
+     * This function is the gated version of <writeI2CV> and <writeReadI2CV>.
+     *
+     * @return see <writeReadI2CV>
+     */
+
+    IOReturn writeReadI2CVGated(const VoodooI2CIOVector* vectors, int* count, UInt8* read_buffer, UInt16* read_length);
+
     /* Check if a boot-arg is present
      *
      * @arg boot-arg property name
@@ -0,0 +1,7 @@
+#!/bin/bash
+cd "$(dirname $0)/.."
+
+OUTPUT=$(mktemp)
+trap 'rm -f "$OUTPUT"' EXIT
+
+c++ -std=gnu++17 -Wall -Werror -o "$OUTPUT" scripts/test_timing.cpp && "$OUTPUT"
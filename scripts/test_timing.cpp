@@ -0,0 +1,83 @@
+// Host-side check of the SCL count helpers in VoodooI2CControllerTiming.hpp
+//
+// The fixed cases pin down the arithmetic (rounding and offsets). They are
+// computed by hand from the same formula, so the sweep below also checks the
+// resulting SCL low and high times against the minimums of the I2C
+// specification, independently of how the counts were derived.
+#include <stdio.h>
+
+#include "../VoodooI2C/VoodooI2C/VoodooI2CController/VoodooI2CControllerTiming.hpp"
+
+static int failures = 0;
+
+static void expect(const char* name, uint32_t actual, uint32_t expected) {
+    if (actual != expected) {
+        printf("FAIL %s: got %u, expected %u\n", name, actual, expected);
+        failures++;
+    }
+}
+
+static const struct {
+    const char* name;
+    uint32_t high_time;
+    uint32_t low_time;
+} modes[] = {
+    {"standard", 4000, 4700},
+    {"fast", 600, 1300},
+    {"fast plus", 260, 500},
+};
+
+static const uint32_t clock_rates[] = {100000, 120000, 133000, 138400, 150000, 216000};
+static const uint32_t falling_times[] = {0, 120, 300};
+
+// The counts are rounded to the closest cycle, so allow for half a cycle
+static bool meets(uint64_t cycles, uint32_t ic_clk, uint64_t nanoseconds) {
+    return (cycles * 2 + 1) * MICRO >= nanoseconds * ic_clk * 2;
+}
+
+static void check_specification() {
+    for (auto& mode : modes) {
+        for (uint32_t ic_clk : clock_rates) {
+            for (uint32_t tf : falling_times) {
+                uint32_t hcnt = i2c_dw_scl_hcnt(ic_clk, mode.high_time, tf, 0, 0);
+                uint32_t lcnt = i2c_dw_scl_lcnt(ic_clk, mode.low_time, tf, 0);
+
+                // SCL is low for LCNT + 1 cycles from the falling edge, of which tf is spent falling
+                if (!meets(lcnt + 1, ic_clk, mode.low_time + tf)) {
+                    printf("FAIL %s tLOW at %u kHz, tf %u ns: lcnt %u\n", mode.name, ic_clk, tf, lcnt);
+                    failures++;
+                }
+
+                // The DW manual puts the SCL high period at HCNT + 8 cycles
+                if (!meets(hcnt + 8, ic_clk, mode.high_time)) {
+                    printf("FAIL %s tHIGH at %u kHz, tf %u ns: hcnt %u\n", mode.name, ic_clk, tf, hcnt);
+                    failures++;
+                }
+            }
+        }
+    }
+}
+
+int main() {
+    // Standard and fast mode with the default 300 ns fall times on a 120 MHz Sunrise Point controller
+    expect("ss hcnt 120 MHz", i2c_dw_scl_hcnt(120000, 4000, 300, 0, 0), 513);
+    expect("ss lcnt 120 MHz", i2c_dw_scl_lcnt(120000, 4700, 300, 0), 599);
+    expect("fs hcnt 120 MHz", i2c_dw_scl_hcnt(120000, 600, 300, 0, 0), 105);
+    expect("fs lcnt 120 MHz", i2c_dw_scl_lcnt(120000, 1300, 300, 0), 191);
+
+    // Results are rounded to the closest count
+    expect("ss hcnt 133 MHz", i2c_dw_scl_hcnt(133000, 4000, 300, 0, 0), 569);
+    expect("fs hcnt 138.4 MHz", i2c_dw_scl_hcnt(138400, 600, 300, 0, 0), 122);
+    expect("fs lcnt 138.4 MHz", i2c_dw_scl_lcnt(138400, 1300, 300, 0), 220);
+
+    // The ideal configuration ignores the fall time, offsets are added as is
+    expect("ss hcnt cond", i2c_dw_scl_hcnt(100000, 4000, 300, 1, 0), 392);
+    expect("fs lcnt offset", i2c_dw_scl_lcnt(133000, 1300, 300, -1), 211);
+
+    check_specification();
+
+    if (!failures)
+        printf("All timing checks passed\n");
+
+    return failures ? 1 : 0;
+}